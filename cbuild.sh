@@ -74,7 +74,7 @@ install() {
 }
 
 print_usage() {
-    echo "Usage: $0 {install|pgobuild|build|debug|fetch|clean|bench}"
+    echo "Usage: $0 {install|pgobuild|build|debug|regcheck|fetch|clean|bench}"
     exit "$1"
 }
 
@@ -94,6 +94,23 @@ while [ $# -gt 0 ] || [ "$1" = "" ]; do
         log "$G" "Entering step: \"Append \"\$CFLAGS\" with debugging flags\""
         set -- build "$@"
         ;;
+    "regcheck")
+        shift
+        # every regex match is repeated by the pike vm, vi aborts on a difference
+        CFLAGS="$CFLAGS -O0 -g -DREG_CHECK"
+        build || exit 1
+        for p in '^static' 'int$' '\<re_' 'lbuf\>' '^$|x' 'a$|^b' '(^|[ \t])if' \
+            'return( |;$)' '(?<=\()int' 'rs(?!et)' '(a|)+?b' 'x{1,2}?y' '[[:alpha:]_]+\('; do
+            printf 'g/%s/\n%%s/%s/&/g\n' "$p" "$p"
+        done > regcheck.ex
+        echo 'q!' >> regcheck.ex
+        for f in ./*.c; do
+            run ./vi -e "$f" < regcheck.ex > /dev/null || { rm -f regcheck.ex; exit 1; }
+        done
+        rm -f regcheck.ex
+        log "$G" "Regex engines agree"
+        exit 0
+        ;;
     "" | "build")
         # If the user doesn't use "build" explicitly, do not run the build step again.
         if [ "$1" = "build" ]; then
@@ -19,6 +19,16 @@ int xmpt;			/* whether to prompt after printing > 1 lines in vi */
 int xpr;			/* ex_cprint register */
 int xlim = -1;			/* rendering cutoff for non cursor lines */
 int xseq = 1;			/* undo/redo sequence */
+int xmm = -1;			/* minimum file size in MiB to memory map; unsafe */
+int xhm;			/* undo history limit in MiB, 0 for none */
+int xhj;			/* undo history kept in memory with a journal in MiB */
+int xhc = 8;			/* undo checkpoints kept per buffer */
+int xil;			/* share equal line records across buffers */
+int xzc;			/* idle periods before unused lines are compressed */
+int xfl;			/* read lines appended to the file, 2: and go to them */
+int xwa;			/* write through a temporary file and rename it */
+int xws;			/* sync written files to disk */
+int xwb;			/* write files in a background process */
 int xerr = 1;			/* error handling -
 				bit 1: print errors, bit 2: early return, bit 3: ignore errors */
 int xfr;			/* ec_find register */
@@ -40,6 +50,11 @@ sbuf *xacreg;			/* autocomplete db filter regex */
 rset *xkwdrs;			/* the last searched keyword rset */
 sbuf **xregs;			/* string registers */
 int xregs_n;			/* allocated register count */
+static struct {
+	char **ln;		/* shared line records */
+	int n;			/* number of lines */
+	sbuf *sb;		/* their text, made when first read */
+} *xregl;			/* registers of whole lines, instead of xregs */
 int xdefreg;			/* ex default register */
 struct buf *bufs;		/* main buffers */
 struct buf tempbufs[3];		/* temporary buffers, for internal use */
@@ -51,6 +66,13 @@ static int xbufsalloc = 10;	/* initial number of buffers */
 static int xgdep;		/* global command recursion depth */
 static int xexp = '%';		/* ex command internal state expand  */
 static int xexe = '!';		/* ex command external command expand */
+int xwbfd = -1;			/* hangs up when the background write ends */
+static struct {
+	pid_t pid;		/* the writing process */
+	struct lbuf *lb;	/* the buffer written */
+	char *path;		/* its new path, if written elsewhere */
+	char msg[512];		/* message shown when done */
+} xwbj;
 static char xuerr[] = "unreported error";
 static char xserr[] = "syntax error";
 static char xgerr[] = "invalid grp";
@@ -127,6 +149,8 @@ static int bufs_find(const char *path, int len)
 
 static void bufs_free(int idx)
 {
+	if (xwbj.pid && xwbj.lb == bufs[idx].lb)
+		ex_wbdone();
 	free(bufs[idx].path);
 	lbuf_free(bufs[idx].lb);
 }
@@ -139,6 +163,19 @@ static long mtime(char *path)
 	return -1;
 }
 
+/* note the modification time and size of the file of p */
+static void bufs_stat(struct buf *p)
+{
+	struct stat st;
+	p->mtime = -1;
+	p->fsz = 0;
+	if (!stat(p->path, &st)) {
+		p->mtime = st.st_mtime;
+		p->fsz = st.st_size;
+	}
+	lbuf_jfile(p->lb, p->path, p->fsz, p->mtime);
+}
+
 void bufs_switch(int idx)
 {
 	if (ex_buf != &bufs[idx]) {
@@ -167,6 +204,7 @@ static int bufs_open(const char *path, int len)
 	bufs[i].top = 0;
 	bufs[i].td = +1;
 	bufs[i].mtime = -1;
+	bufs[i].fsz = 0;
 	return i;
 }
 
@@ -179,6 +217,7 @@ void temp_open(int i, char *name, char *ft)
 	tempbufs[i].top = 0;
 	tempbufs[i].td = +1;
 	tempbufs[i].mtime = -1;
+	tempbufs[i].fsz = 0;
 	tempbufs[i].ft = ft;
 }
 
@@ -387,10 +426,10 @@ static int ex_read(sbuf *sb, char *msg, ins_state *is, int ps, int flg)
 	return key;
 }
 
-#define readfile(errchk) \
+#define readfile(errchk, reload) \
 fd = open(xb_path, O_RDONLY); \
 if (fd >= 0) { \
-	errchk lbuf_rd(xb, fd, 0, lbuf_len(xb)); \
+	errchk lbuf_rd(xb, fd, 0, lbuf_len(xb), !(xvis & 2), reload); \
 	close(fd); \
 } \
 
@@ -406,7 +445,7 @@ int ex_edit(const char *path, int len)
 		return 1;
 	}
 	bufs_switch(bufs_open(path, len));
-	readfile()
+	readfile(, 0)
 	return 0;
 }
 
@@ -414,6 +453,7 @@ static void *ec_edit(char *loc, char *cmd, char *arg)
 {
 	char msg[512];
 	int fd, len, rd = 0, cd = 0;
+	ex_wbdone();
 	if (arg[0] == '.' && arg[1] == '/')
 		cd = 2;
 	len = strlen(arg+cd);
@@ -427,7 +467,7 @@ static void *ec_edit(char *loc, char *cmd, char *arg)
 		bufs_switch(bufs_open(arg+cd, len));
 		cd = 3; /* XXX: quick hack to indicate new lbuf */
 	}
-	readfile(rd =)
+	readfile(rd =, cd != 3)	/* :e! keeps what did not change */
 	if (cd == 3 || (!rd && fd >= 0)) {
 		ex_bufpostfix(ex_buf, arg[0]);
 		syn_setft(xb_ft);
@@ -480,7 +520,7 @@ static void *ec_fuzz(char *loc, char *cmd, char *arg)
 			dwid2 = itoalen(end);
 			dwid1 = max == INT_MAX ? dwid2 : MIN(dwid1, dwid2);
 			for (pos = beg; c < max && pos < end; pos++) {
-				path = xb->ln[pos];
+				path = lbuf_get(xb, pos);
 				if (rset_match(rs, path, 0)) {
 					sbuf_mem(sb, &pos, sizeof(pos))
 					p = itoa(c++, buf);
@@ -537,7 +577,7 @@ static void *ec_fuzz(char *loc, char *cmd, char *arg)
 		sbuf_str(cmdbuf, cmd)
 		sbuf_chr(cmdbuf, ' ')
 		sbufn_mem(cmdbuf, fuzz->s, fuzz->s_n)
-		lbuf_dedup(tempbufs[0].lb, cmdbuf->s, cmdbuf->s_n)
+		lbuf_dedup(tempbufs[0].lb, cmdbuf->s, cmdbuf->s_n);
 		temp_pos(0, -1, 0, 0);
 		temp_write(0, cmdbuf->s);
 	}
@@ -644,6 +684,7 @@ static void *ec_buffer(char *loc, char *cmd, char *arg)
 
 static void *ec_quit(char *loc, char *cmd, char *arg)
 {
+	ex_wbdone();
 	if (xexec_dep == 1 && xgrec == 1 && !strchr(cmd, '!') && xquit >= 0)
 		for (int i = 0; i < xbufcur; i++)
 			if (bufs[i].lb->modified)
@@ -661,9 +702,34 @@ static void *ec_quit(char *loc, char *cmd, char *arg)
 
 void ex_bufpostfix(struct buf *p, int clear)
 {
-	p->mtime = mtime(p->path);
-	p->ft = syn_filetype(p->path);
 	lbuf_saved(p->lb, clear);
+	bufs_stat(p);
+	p->ft = syn_filetype(p->path);
+}
+
+/* append the lines added to the file of the current buffer since it
+was last read, written or followed; returns nonzero if there were any */
+int ex_follow(void)
+{
+	struct stat st;
+	int fd, mod = xb->modified;
+	long off;
+	if (!*xb_path || istempbuf(ex_buf) || stat(xb_path, &st) || !S_ISREG(st.st_mode))
+		return 0;
+	if (st.st_size < ex_buf->fsz)	/* truncated; follow its new end */
+		ex_buf->fsz = st.st_size;
+	if (st.st_size == ex_buf->fsz || (fd = open(xb_path, O_RDONLY)) < 0)
+		return 0;
+	off = lbuf_tail(xb, fd, ex_buf->fsz);
+	close(fd);
+	if (off < 0)
+		return 0;
+	xb->useq += xseq;	/* undone on its own */
+	if (!mod)
+		lbuf_saved(xb, 0);
+	ex_buf->mtime = st.st_mtime;
+	ex_buf->fsz = off;
+	return 1;
 }
 
 static void *ec_setpath(char *loc, char *cmd, char *arg)
@@ -682,6 +748,7 @@ static void *ec_read(char *loc, char *cmd, char *arg)
 	int beg, end, o1 = 0, o2 = -1;
 	int row = xrow, off = xoff, fd = -1;
 	struct lbuf *lb = lbuf_make(), *pxb = xb;
+	ex_wbdone();
 	path = arg[0] ? arg : xb_path;
 	if (arg[0] == '!') {
 		if ((sb = cmd_pipe(arg + 1, NULL, 1, NULL))) {
@@ -693,7 +760,7 @@ static void *ec_read(char *loc, char *cmd, char *arg)
 			ret = "open failed";
 			goto err;
 		}
-		if (lbuf_rd(lb, fd, 0, 0)) {
+		if (lbuf_rd(lb, fd, 0, 0, 0, 0)) {
 			ret = "read failed";
 			goto err;
 		}
@@ -709,9 +776,13 @@ static void *ec_read(char *loc, char *cmd, char *arg)
 		}
 		beg = 0;
 	}
-	lbuf_region(lb, &obuf, beg, o1, end - 1, o2);
-	lbuf_edit(pxb, obuf.s, row, row, 0, 0);
-	free(obuf.s);
+	if (!o1 && o2 < 0)	/* whole lines move over as they are */
+		lbuf_move(pxb, row, lb, beg, end);
+	else {
+		lbuf_region(lb, &obuf, beg, o1, end - 1, o2);
+		lbuf_edit(pxb, obuf.s, row, row, 0, 0);
+		free(obuf.s);
+	}
 	snprintf(msg, sizeof(msg), "\"%s\" %dL [r]", path, end - beg);
 	ex_print(msg, bar_ft)
 	err:
@@ -742,12 +813,73 @@ static void *ex_pipeout(char *cmd, sbuf *buf)
 	return ret ? xuerr : NULL;
 }
 
+/* wait for the background write; returns its message or error */
+char *ex_wbdone(void)
+{
+	int st, w, i;
+	if (!xwbj.pid)
+		return NULL;
+	while ((w = waitpid(xwbj.pid, &st, 0)) < 0 && errno == EINTR);
+	close(xwbfd);
+	xwbfd = -1;
+	xwbj.pid = 0;
+	st = w > 0 && WIFEXITED(st) && !WEXITSTATUS(st);	/* lost children failed */
+	for (i = 0; i < xbufcur && bufs[i].lb != xwbj.lb; i++);
+	if (st && xwbj.path && i < xbufcur) {
+		free(bufs[i].path);
+		bufs[i].path = xwbj.path;
+		bufs[i].plen = strlen(xwbj.path);
+	} else
+		free(xwbj.path);
+	xwbj.path = NULL;
+	if (!st) {
+		xwbj.lb->wsaved = -1;
+		return "write failed";
+	}
+	lbuf_wsaved(xwbj.lb, 1);
+	if (i < xbufcur)
+		bufs_stat(&bufs[i]);
+	return xwbj.msg;
+}
+
+/* write lines or a region to fd, renaming tmp to path if given */
+static int ex_wrfile(int fd, char *tmp, char *path,
+		int beg, int end, int o1, int o2)
+{
+	sbuf ibuf;
+	if (o1 >= 0) {
+		lbuf_region(xb, &ibuf, beg, o1, end - 1, o2);
+		o1 = write(fd, ibuf.s, ibuf.s_n);
+		free(ibuf.s);
+	} else
+		o1 = lbuf_wr(xb, fd, beg, end);
+	if (o1 >= 0 && xws)
+#if _POSIX_SYNCHRONIZED_IO > 0
+		o1 = fdatasync(fd);	/* skips timestamps, not the size */
+#else
+		o1 = fsync(fd);
+#endif
+	if (close(fd) < 0)
+		o1 = -1;
+	if (*tmp && (o1 < 0 || rename(tmp, path) < 0)) {
+		unlink(tmp);
+		o1 = -1;
+	}
+	return o1;
+}
+
 static void *ec_write(char *loc, char *cmd, char *arg)
 {
 	char msg[512], *path, *ret = NULL;
+	struct stat st;
 	sbuf ibuf;
-	int fd, quit = xquit;
+	int fd, quit = xquit, pfd[2];
 	int beg, end, o1 = -1, o2 = -1;
+	pid_t pid = -1;
+	/* report the last background write once and go on with this one */
+	if ((ret = ex_wbdone()))
+		ex_print(ret, ret == xwbj.msg ? bar_ft : msg_ft)
+	ret = NULL;
 	path = arg[0] ? arg : xb_path;
 	if (cmd[0] == 'x' && !xb->modified)
 		return ec_quit("", cmd, "");
@@ -779,28 +911,66 @@ static void *ec_write(char *loc, char *cmd, char *arg)
 	if (!strchr(cmd, '!')) {
 		if (!strcmp(xb_path, path) && mtime(path) > ex_buf->mtime)
 			return "write failed: file changed";
+		if (!strcmp(xb_path, path) && xb->rderr)
+			return "write failed: file read in part";
 		if (arg[0] && mtime(path) >= 0)
 			return "write failed: file exists";
 	}
-	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, conf_mode);
+	char tmp[strlen(path) + 8];
+	/* replacing keeps links and symlinks only when written in place */
+	int tmpw = xwa && !lstat(path, &st) && S_ISREG(st.st_mode) && st.st_nlink == 1;
+	*tmp = '\0';
+	if (tmpw) {
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+		/* without a writable directory or the owner, write in place */
+		if ((fd = mkstemp(tmp)) >= 0 && (fchown(fd, st.st_uid, st.st_gid) < 0
+				|| fchmod(fd, st.st_mode & 07777) < 0)) {
+			close(fd);
+			unlink(tmp);
+			fd = -1;
+		}
+		if (fd < 0)
+			*tmp = '\0';
+	}
+	if (!*tmp) {
+		if (!stat(path, &st))	/* truncating a mapped file faults its lines */
+			for (fd = 0; fd < xbufcur; fd++)
+				lbuf_unmap(bufs[fd].lb, &st);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, conf_mode);
+	}
 	if (fd < 0)
 		return "write failed: cannot create file";
-	if (o1 >= 0) {
-		lbuf_region(xb, &ibuf, beg, o1, end - 1, o2);
-		o1 = write(fd, ibuf.s, ibuf.s_n);
-		free(ibuf.s);
-	} else
-		o1 = lbuf_wr(xb, fd, beg, end);
-	close(fd);
-	if (o1 < 0)
-		return "write failed";
 	snprintf(msg, sizeof(msg), "\"%s\" %dL [w]",
 			path, end - beg);
+	/* the child writes a copy on write snapshot of the buffer */
+	if (xwb && o1 < 0 && !(xvis & 2) && quit == xquit && !pipe(pfd)) {
+		if (!(pid = fork())) {
+			close(pfd[0]);
+			_exit(ex_wrfile(fd, tmp, path, beg, end, o1, o2) < 0);
+		}
+		close(pfd[1]);
+		if (pid < 0)
+			close(pfd[0]);
+	}
+	if (pid > 0) {
+		close(fd);
+		xwbfd = pfd[0];
+		xwbj.pid = pid;
+		xwbj.lb = xb;
+		xwbj.path = strcmp(xb_path, path) ? uc_dup(path) : NULL;
+		strcpy(xwbj.msg, msg);
+		lbuf_wsaved(xb, 0);
+		snprintf(msg, sizeof(msg), "\"%s\" %dL [writing]",
+				path, end - beg);
+		ex_print(msg, bar_ft)
+		return NULL;
+	} else if (ex_wrfile(fd, tmp, path, beg, end, o1, o2) < 0)
+		return "write failed";
 	ex_print(msg, bar_ft)
 	if (strcmp(xb_path, path))
 		ec_setpath(NULL, NULL, path);
 	lbuf_saved(xb, 0);
-	ex_buf->mtime = mtime(path);
+	bufs_stat(ex_buf);
 	xquit = quit;
 	return NULL;
 }
@@ -971,20 +1141,71 @@ static void *ec_delete(char *loc, char *cmd, char *arg)
 	return NULL;
 }
 
+static void ex_regmake(int c)
+{
+	if (c < xregs_n)
+		return;
+	int o = xregs_n;
+	xregs_n = c + 1;
+	xregs = erealloc(xregs, xregs_n * sizeof(xregs[0]));
+	xregl = erealloc(xregl, xregs_n * sizeof(xregl[0]));
+	memset(xregs + o, 0, (xregs_n - o) * sizeof(xregs[0]));
+	memset(xregl + o, 0, (xregs_n - o) * sizeof(xregl[0]));
+}
+
+/* empty register c, returning nonzero if it was empty already */
+static int ex_regfree(int c)
+{
+	if (c < 0 || c >= xregs_n || (!xregs[c] && !xregl[c].ln))
+		return 1;
+	if (xregs[c])
+		sbuf_free(xregs[c])
+	xregs[c] = NULL;
+	if (xregl[c].sb)
+		sbuf_free(xregl[c].sb)
+	xregl[c].sb = NULL;
+	lbuf_ldrop(xregl[c].ln, xregl[c].n);
+	free(xregl[c].ln);
+	xregl[c].ln = NULL;
+	xregl[c].n = 0;
+	return 0;
+}
+
 sbuf *ex_regget(int id)
 {
-	return id >= 0 && id < xregs_n ? xregs[id] : NULL;
+	if (id < 0 || id >= xregs_n)
+		return NULL;
+	if (xregl[id].ln && !xregl[id].sb) {	/* the lines stay shared */
+		sbuf *sb;
+		sbuf_make(sb, 64)
+		for (int i = 0; i < xregl[id].n; i++)
+			sbuf_mem(sb, xregl[id].ln[i], lbuf_s(xregl[id].ln[i])->len + 1)
+		sbufn_null(sb)
+		xregl[id].sb = sb;
+	}
+	return xregl[id].ln ? xregl[id].sb : xregs[id];
+}
+
+/* the shared lines of register id, or NULL if it holds text */
+char **ex_reglines(int id, int *n)
+{
+	if (id < 0 || id >= xregs_n || !xregl[id].n)
+		return NULL;
+	*n = xregl[id].n;
+	return xregl[id].ln;
 }
 
 void ex_regput(int c, const char *s, int append)
 {
 	sbuf *sb;
-	if (c >= xregs_n) {
-		int o = xregs_n;
-		xregs_n = c + 1;
-		xregs = erealloc(xregs, xregs_n * sizeof(xregs[0]));
-		memset(xregs + o, 0, (xregs_n - o) * sizeof(xregs[0]));
-	}
+	ex_regmake(c);
+	if (append && xregl[c].ln) {	/* appended text turns lines into text */
+		sb = ex_regget(c);
+		xregl[c].sb = NULL;
+		ex_regfree(c);
+		xregs[c] = sb;
+	} else if (xregl[c].ln)
+		ex_regfree(c);
 	sb = xregs[c];
 	if (!sb) {
 		sbuf_make(sb, 64)
@@ -996,21 +1217,47 @@ void ex_regput(int c, const char *s, int append)
 	sbufn_null(sb)
 }
 
+/* share lines beg through end of lb in register c */
+void ex_regputln(int c, struct lbuf *lb, int beg, int end)
+{
+	end = MIN(end, lbuf_len(lb));
+	beg = MIN(MAX(beg, 0), end);
+	ex_regmake(c);
+	ex_regfree(c);
+	xregl[c].ln = lbuf_lshare(lb, beg, end);
+	xregl[c].n = end - beg;
+}
+
+/* copy register src to dst, if src is set */
+void ex_regcopy(int dst, int src)
+{
+	if (src < 0 || src >= xregs_n || src == dst)
+		return;
+	if (xregl[src].ln) {
+		char **ln = lbuf_lcopy(xregl[src].ln, xregl[src].n);
+		int n = xregl[src].n;
+		ex_regmake(dst);
+		ex_regfree(dst);
+		xregl[dst].ln = ln;
+		xregl[dst].n = n;
+	} else if (xregs[src])
+		ex_regput(dst, xregs[src]->s, 0);
+}
+
 static void *ec_yank(char *loc, char *cmd, char *arg)
 {
 	int beg, end, o1 = 0, o2 = -1;
 	int reg = atoi(arg);
 	if (reg < 0)
 		return xserr;
-	if (cmd[2] == '!') {
-		sbuf *sb = ex_regget(reg);
-		if (!sb)
-			return xuerr;
-		sbuf_free(sb)
-		xregs[reg] = NULL;
-		return NULL;
-	} else if (ex_region(loc, &beg, &end, &o1, &o2))
+	if (cmd[2] == '!')
+		return ex_regfree(reg) ? xuerr : NULL;
+	else if (ex_region(loc, &beg, &end, &o1, &o2))
 		return xrerr;
+	if (!o1 && o2 < 0 && cmd[2] != '+') {
+		ex_regputln(reg, xb, beg, end);
+		return NULL;
+	}
 	sbuf sb;
 	lbuf_region(xb, &sb, beg, o1, end - 1, o2);
 	ex_regput(reg, sb.s, cmd[2] == '+');
@@ -1020,15 +1267,15 @@ static void *ec_yank(char *loc, char *cmd, char *arg)
 
 static void *ec_put(char *loc, char *cmd, char *arg)
 {
-	int beg, end, i = 0, reg = xdefreg;
-	sbuf *buf;
+	int beg, end, i = 0, reg = xdefreg, rn;
+	char **rl;
 	for (; uc_isdigit(arg[i]); i++)
 		reg = i ? reg * 10 + (arg[i] - '0') : arg[i] - '0';
-	if (!(buf = ex_regget(reg)))
+	if (!ex_reglines(reg, &rn) && !ex_regget(reg))
 		return "uninitialized register";
 	for (; arg[i] && arg[i] != '!'; i++);
 	if (arg[i] == '!' && arg[i+1])
-		return ex_pipeout(arg + i + 1, buf);
+		return ex_pipeout(arg + i + 1, ex_regget(reg));
 	int n = lbuf_len(xb), o1 = -1, o2 = -1;
 	if (!*loc || (i = ex_region(loc, &beg, &end, &o1, &o2))) {
 		if (*loc && i != 2 && !(beg == -1 && end == 0 && o1 < 0
@@ -1040,11 +1287,13 @@ static void *ec_put(char *loc, char *cmd, char *arg)
 		}
 	}
 	if (o1 >= 0) {
-		char *p = lbuf_joinsb(xb, end - 1, end - 1, buf, &o1, &o2);
+		char *p = lbuf_joinsb(xb, end - 1, end - 1, ex_regget(reg), &o1, &o2);
 		lbuf_edit(xb, p, end - 1, end, o1, o1);
 		free(p);
-	} else
-		lbuf_edit(xb, buf->s, end, end, o1, o1);
+	} else if ((rl = ex_reglines(reg, &rn)))
+		lbuf_lput(xb, end, rl, rn, 1, o1);
+	else
+		lbuf_edit(xb, ex_regget(reg)->s, end, end, o1, o1);
 	xrow = MIN(lbuf_len(xb) - 1, end + lbuf_len(xb) - n - 1);
 	return NULL;
 }
@@ -1072,8 +1321,8 @@ static void *ec_num(char *loc, char *cmd, char *arg)
 static void *ec_undoredo(char *loc, char *cmd, char *arg)
 {
 	int ref;
-	return (cmd[0] == 'u' ? lbuf_undo : lbuf_redo)(xb, &ref, &ref) ?
-		xuerr : NULL;
+	return (cmd[0] == 'u' ? lbuf_undo : lbuf_redo)(xb, &ref, &ref,
+		MAX(1, atoi(arg))) ? xuerr : NULL;
 }
 
 static void *ec_bufsave(char *loc, char *cmd, char *arg)
@@ -1104,17 +1353,19 @@ static void *ec_substitute(char *loc, char *cmd, char *arg)
 	char *pat, *rep = NULL, *_rep, *p, *err = NULL;
 	char *s = arg;
 	rset *rs = xkwdrs;
-	int i, first = -1, last = 0;
+	int i, first = -1, last = 0, own = 0;
 	struct lopt *lo;
 	sbuf text, *rb;
 	int e = ex_region(loc, &beg, &end, &o1, &o2);
 	if (e && *loc)
 		return xrerr;
 	pat = ex_re_read(&s);
-	if (pat && (*pat || !rs))
+	if (pat && (*pat || !rs)) {
 		rs = rset_smake(pat, xic ? REG_ICASE : 0);
+		own = 1;	/* the cache may return xkwdrs itself */
+	}
 	if (!rs || xgrp >= rs->nsubc) {
-		if (rs != xkwdrs)
+		if (own)
 			rset_free(rs);
 		free(pat);
 		return rs ? xgerr : xserr;
@@ -1167,9 +1418,9 @@ static void *ec_substitute(char *loc, char *cmd, char *arg)
 	}
 	for (i = beg; i < end; i++) {
 		lnb = lbuf_get(xb, i), ln = lnb, suf = "";
-		b1 = o1 > 0 && i == beg ? uc_chr(lnb, o1) - lnb : 0;
+		b1 = o1 > 0 && i == beg ? lbuf_chr(lnb, o1) - lnb : 0;
 		if (o2 >= 0 && i == end - 1)
-			suf = uc_chr(lnb, o2);
+			suf = lbuf_chr(lnb, o2);
 		rflg = *suf ? 0 : REG_NEWLINE;
 		if (*suf) {		/* line ends at an offset */
 			free(fr);	/* o1 past o2 spans to the line end */
@@ -1243,7 +1494,7 @@ static void *ec_substitute(char *loc, char *cmd, char *arg)
 	}
 	out:
 	free(fr);
-	if (rs != xkwdrs)
+	if (own)
 		rset_free(rs);
 	free(rep);
 	return err ? err : first < 0 ? xuerr : NULL;
@@ -1328,7 +1579,7 @@ static void *ec_glob(char *loc, char *cmd, char *arg)
 		return xserr;
 	xgdep = !xgdep ? 1 : xgdep * 2;
 	for (i = beg; i < end; i++)
-		lbuf_i(xb, i)->grec |= xgdep;
+		lbuf_s(lbuf_own(xb, i))->grec |= xgdep;
 	for (i = beg; i < lbuf_len(xb);) {
 		char *ln = lbuf_get(xb, i);
 		lbuf_s(ln)->grec &= ~xgdep;
@@ -1520,7 +1771,7 @@ static void *ec_regprint(char *loc, char *cmd, char *arg)
 	int wid = itoalen(xregs_n - 1);
 	preserve(int, xtd, xtd = 2;)
 	for (int i = 0; i < xregs_n; i++) {
-		if (xregs[i] && !(xpr > 0 && i == xpr)) {
+		if (ex_regget(i) && !(xpr > 0 && i == xpr)) {
 			char *e = buf;
 			for (int p = itoalen(i); p < wid; p++)
 				*e++ = ' ';
@@ -1530,7 +1781,7 @@ static void *ec_regprint(char *loc, char *cmd, char *arg)
 			*e++ = ' ';
 			*e = '\0';
 			ex_cprint2(buf, msg_ft, -1, 0, 0, flg)
-			ex_cprint2(xregs[i]->s, msg_ft, -1, xleft ? 0 : e - buf, xleft, !flg)
+			ex_cprint2(ex_regget(i)->s, msg_ft, -1, xleft ? 0 : e - buf, xleft, !flg)
 		}
 	}
 	restore(xtd)
@@ -1641,7 +1892,8 @@ static void *eo_##opt(char *loc, char *cmd, char *arg) { inner }
 
 EO(pac) EO(pr) EO(ai) EO(err) EO(fr) EO(ish) EO(ic) EO(mpt)
 EO(rr) EO(shape) EO(seq) EO(td) EO(order) EO(hll) EO(hlw)
-EO(hlp) EO(hlr) EO(hl) EO(lim) EO(led) EO(vis)
+EO(hlp) EO(hlr) EO(hl) EO(lim) EO(led) EO(vis) EO(mm) EO(wa) EO(ws) EO(wb)
+EO(hm) EO(hj) EO(hc) EO(il) EO(zc) EO(fl)
 
 _EO(ts, xts = *arg ? MAX(0, eo_val(arg)) : !xts; return NULL;)
 _EO(grp, xgrp = (*arg ? MAX(0, eo_val(arg)) : !xgrp) * 2; return NULL;)
@@ -1657,12 +1909,13 @@ _EO(left,
 )
 
 #undef EO
-#define EO(opt) {#opt, eo_##opt}
+#define EO(opt) {#opt, eo_##opt, 1}
 
 /* commands & opts must be sorted longest of its kind topmost */
 static struct excmd {
 	char *name;
 	void *(*ec)(char *loc, char *cmd, char *arg);
+	int opt;	/* sets an option; runs without the whole file */
 } excmds[] = {
 	{"@", ec_termexec},
 	{"&", ec_termexec},
@@ -1694,6 +1947,7 @@ static struct excmd {
 	{"fd", ec_setdir},
 	{"fp", ec_setdir},
 	EO(fr),
+	EO(fl),
 	{"f+", ec_find},
 	{"f-", ec_find},
 	{"f>", ec_find},
@@ -1702,12 +1956,14 @@ static struct excmd {
 	EO(ish),
 	{"inc", ec_setincl},
 	EO(ic),
+	EO(il),
 	{"i", ec_insert},
 	{"d", ec_delete},
 	EO(grp),
 	{"g!", ec_glob},
 	{"g", ec_glob},
 	EO(mpt),
+	EO(mm),
 	{"m", ec_mark},
 	{"q!", ec_quit},
 	{"q", ec_quit},
@@ -1717,6 +1973,9 @@ static struct excmd {
 	{"rd", ec_undoredo},
 	EO(rr),
 	{"r", ec_read},
+	EO(wa),
+	EO(ws),
+	EO(wb),
 	{"wq!", ec_write},
 	{"wq", ec_write},
 	{"w!", ec_write},
@@ -1748,6 +2007,10 @@ static struct excmd {
 	EO(hlp),
 	EO(hlr),
 	EO(hl),
+	EO(hm),
+	EO(hj),
+	EO(hc),
+	EO(zc),
 	EO(left),
 	EO(lim),
 	EO(led),
@@ -1865,6 +2128,8 @@ void *ex_exec(const char *ln)
 	do {
 		sbuf_cut(sb, 0)
 		ln = ex_arg(ex_cmd(ln, sb, &idx), sb, &arg);
+		if (!excmds[idx].opt && excmds[idx].ec != ec_quit && lbuf_load(-1) < -1)
+			ex_print("read failed", msg_ft)
 		ret = excmds[idx].ec(sb->s, excmds[idx].name, sb->s + arg);
 		xpret = ret;
 		if (ret && ret != xuerr && xerr & 1) {
@@ -1,22 +1,573 @@
+/* a file read into an lbuf, possibly over several calls */
+struct lload {
+	struct lbuf *lb;
+	int fd;			/* the file, or -1 if mapped */
+	int map;		/* the mapping being indexed */
+	size_t off, sz;		/* bytes consumed and file size */
+	int nul;		/* a nul ended the text */
+	sbuf *part;		/* line split across reads */
+};
+
+#define LOAD_STEP	(1 << 22)	/* bytes loaded per idle step */
+static struct lload lbuf_bg;	/* file loading in the background */
+static int lbuf_tick;		/* idle periods so far, see lbuf_cold() */
+static void lbuf_zload(struct lbuf *lb, int b);
+static void lbuf_lref(char *ln);
+static void lbuf_lfree(struct lbuf *lb, char *ln);
+static void lbuf_chkdel(struct lbuf *lb, int i);
+
+static void lbuf_ldend(struct lload *ld, int bg)
+{
+	if (ld->part)
+		sbuf_free(ld->part)
+	if (bg && ld->fd >= 0)
+		close(ld->fd);
+	ld->lb = NULL;
+}
+
 struct lbuf *lbuf_make(void)
 {
 	struct lbuf *lb = emalloc(sizeof(*lb));
 	memset(lb, 0, sizeof(*lb));
 	lb->mark_sb[0] = -1;
 	lb->mark_se[0] = -1;
+	lb->wsaved = -1;
+	lb->jfd = -1;
 	return lb;
 }
 
-static void lopt_done(struct lopt *lo)
+#define lbuf_tagged(ln) ((size_t)(ln) & 1)
+
+static struct lmap *lbuf_tagmap(struct lbuf *lb, char *ln)
+{
+	size_t t = (size_t)ln >> 1;
+	for (int i = 0; i < lb->map_n; i++)
+		if (t >= lb->map[i].base && t < lb->map[i].base + lb->map[i].sz)
+			return &lb->map[i];
+	return NULL;
+}
+
+/* the text of a line, either a record or a '\n' terminated mapped line */
+static char *lbuf_text(struct lbuf *lb, char *ln, int *len)
+{
+	if (!lbuf_tagged(ln)) {
+		*len = lbuf_s(ln)->len;
+		return ln;
+	}
+	struct lmap *m = lbuf_tagmap(lb, ln);
+	char *s = m->s + (((size_t)ln >> 1) - m->base);
+	*len = (char*)memchr(s, '\n', m->s + m->sz - s) - s;
+	return s;
+}
+
+/* bytes taken by n lines, including their newlines */
+static long lbuf_bytes(struct lbuf *lb, char **ln, int n)
+{
+	long sz = n;
+	int len;
+	for (int i = 0; i < n; i++) {
+		lbuf_text(lb, ln[i], &len);
+		sz += len;
+	}
+	return sz;
+}
+
+static void lbuf_bfenadd(struct lbuf *lb, int b, long d)
+{
+	struct lblk *k = lb->blk[b];
+	if (k->bytes >= 0)
+		k->bytes += d;
+	for (b++; lb->bfen_ok && b <= lb->blk_n; b += b & -b)
+		lb->bfen[b] += d;
+}
+
+static void lbuf_fenmake(struct lbuf *lb)
+{
+	int i, j;
+	for (i = 1; i <= lb->blk_n; i++)
+		lb->fen[i] = lb->blk[i - 1]->n;
+	for (i = 1; i <= lb->blk_n; i++)
+		if ((j = i + (i & -i)) <= lb->blk_n)
+			lb->fen[j] += lb->fen[i];
+	lb->blk_c = 0;
+	lb->blk_o = 0;
+	lb->bfen_ok = 0;
+	lb->ptree_n = 0;
+}
+
+static void lbuf_fenadd(struct lbuf *lb, int b, int d)
+{
+	for (b++; b <= lb->blk_n; b += b & -b)
+		lb->fen[b] += d;
+	lb->blk_c = 0;
+	lb->blk_o = 0;
+}
+
+/* the block holding line pos, with pos's index in it stored in off */
+static int lbuf_blk(struct lbuf *lb, int pos, int *off)
 {
+	int b = lb->blk_c, o = lb->blk_o, i;
+	if (b < lb->blk_n && pos >= o) {	/* sequential access */
+		if (pos - o >= lb->blk[b]->n && b + 1 < lb->blk_n)
+			o += lb->blk[b++]->n;
+	} else if (b > 0 && pos < o)
+		o -= lb->blk[--b]->n;
+	if (b >= lb->blk_n || pos < o || pos - o >= lb->blk[b]->n) {
+		for (i = 1; i <= lb->blk_n / 2; i <<= 1);
+		for (b = 0, o = 0; i; i >>= 1)
+			if (b + i <= lb->blk_n && o + lb->fen[b + i] <= pos)
+				o += lb->fen[b += i];
+	}
+	lb->blk_c = b;
+	lb->blk_o = o;
+	*off = pos - o;
+	return b;
+}
+
+/* block b with its lines decompressed */
+static struct lblk *lbuf_k(struct lbuf *lb, int b)
+{
+	if (lb->blk[b]->z)
+		lbuf_zload(lb, b);
+	lb->blk[b]->used = lbuf_tick;
+	return lb->blk[b];
+}
+
+/* block b for changing its lines, copied first if checkpoints share
+it; a block holds a user of each of its lines, so the copy adds one */
+static struct lblk *lbuf_kw(struct lbuf *lb, int b)
+{
+	struct lblk *k = lbuf_k(lb, b);
+	if (!k->shr)
+		return k;
+	k->shr--;
+	k = memcpy(emalloc(sizeof(*k)), k, sizeof(*k));
+	k->shr = 0;
+	for (int i = 0; i < k->n; i++)
+		lbuf_lref(k->ln[i]);
+	return lb->blk[b] = k;
+}
+
+/* drop a user of block k, freeing it and its lines after the last */
+static void lbuf_kput(struct lbuf *lb, struct lblk *k)
+{
+	if (k->shr) {
+		k->shr--;
+		return;
+	}
+	for (int i = 0; !k->z && i < k->n; i++)
+		lbuf_lfree(lb, k->ln[i]);
+	free(k->z);
+	free(k);
+}
+
+/* rebuild the byte index, measuring blocks not yet measured */
+static void lbuf_bfenmake(struct lbuf *lb)
+{
+	int i, j;
+	for (i = 1; i <= lb->blk_n; i++) {
+		struct lblk *k = lb->blk[i - 1];
+		if (k->bytes < 0)
+			k->bytes = lbuf_bytes(lb, k->ln, k->n);
+		lb->bfen[i] = k->bytes;
+	}
+	for (i = 1; i <= lb->blk_n; i++)
+		if ((j = i + (i & -i)) <= lb->blk_n)
+			lb->bfen[j] += lb->bfen[i];
+	lb->bfen_ok = 1;
+}
+
+/* byte offset of the start of line pos */
+static long lbuf_boff(struct lbuf *lb, int pos)
+{
+	long sz = 0;
+	int i, off, b = lb->blk_n;
+	if (!lb->bfen_ok)
+		lbuf_bfenmake(lb);
+	if (pos < lb->ln_n)
+		b = lbuf_blk(lb, pos, &off);
+	for (i = b; i > 0; i -= i & -i)
+		sz += lb->bfen[i];
+	if (b == lb->blk_n)
+		return sz;
+	struct lblk *k = lbuf_k(lb, b);
+	if (off > k->n / 2)
+		return sz + k->bytes - lbuf_bytes(lb, k->ln + off, k->n - off);
+	return sz + lbuf_bytes(lb, k->ln, off);
+}
+
+/* the line containing byte offset boff, with the offset in it stored in off */
+static int lbuf_brow(struct lbuf *lb, long boff, long *off)
+{
+	int i, b = 0, row = 0, len;
+	if (!lb->bfen_ok)
+		lbuf_bfenmake(lb);
+	for (i = 1; i <= lb->blk_n / 2; i <<= 1);
+	for (; i; i >>= 1)
+		if (b + i <= lb->blk_n && lb->bfen[b + i] <= boff) {
+			b += i;
+			boff -= lb->bfen[b];
+			row += lb->fen[b];
+		}
+	if (b >= lb->blk_n || boff < 0)
+		return -1;
+	struct lblk *k = lbuf_k(lb, b);
+	for (i = 0; i < k->n; i++) {
+		lbuf_text(lb, k->ln[i], &len);
+		if (boff <= len)
+			break;
+		boff -= len + 1;
+	}
+	*off = boff;
+	return row + i;
+}
+
+static char **lbuf_ln(struct lbuf *lb, int pos)
+{
+	int off, b = lbuf_blk(lb, pos, &off);
+	return &lbuf_k(lb, b)->ln[off];
+}
+
+static unsigned lbuf_hash(char *s, int n)
+{
+	unsigned h = 2166136261u;
+	for (int i = 0; i < n; i++)
+		h = (h ^ (unsigned char) s[i]) * 16777619u;
+	return h | 1;
+}
+
+/* the count of lines hashing to h; if add, a new count if missing */
+static unsigned *lbuf_hcnt(struct lbuf *lb, unsigned h, int add)
+{
+	int i = h & (lb->hash_sz - 1);
+	for (; lb->hash[i * 2]; i = (i + 1) & (lb->hash_sz - 1))
+		if (lb->hash[i * 2] == h)
+			return &lb->hash[i * 2 + 1];
+	if (!add)
+		return NULL;
+	lb->hash[i * 2] = h;
+	lb->hash_n++;
+	return &lb->hash[i * 2 + 1];
+}
+
+/* count the hashes of lbuf lines, with room for n lines */
+static void lbuf_hashmake(struct lbuf *lb, int n)
+{
+	int i, len;
+	char *s;
+	for (lb->hash_sz = 64; lb->hash_sz < n * 4; lb->hash_sz *= 2);
+	free(lb->hash);
+	lb->hash = emalloc(lb->hash_sz * 2 * sizeof(lb->hash[0]));
+	memset(lb->hash, 0, lb->hash_sz * 2 * sizeof(lb->hash[0]));
+	lb->hash_n = 0;
+	for (i = 0; i < lb->ln_n; i++) {
+		s = lbuf_text(lb, *lbuf_ln(lb, i), &len);
+		(*lbuf_hcnt(lb, lbuf_hash(s, len), 1))++;
+	}
+}
+
+/* update line hash counts for a splice */
+static void lbuf_hashsplice(struct lbuf *lb, int pos, int n_del, char **ins, int n_ins)
+{
+	int i, len;
+	char *s;
+	if ((lb->hash_n + n_ins) * 2 > lb->hash_sz)
+		lbuf_hashmake(lb, lb->ln_n + n_ins);
+	for (i = 0; i < n_del; i++) {
+		s = lbuf_text(lb, *lbuf_ln(lb, pos + i), &len);
+		(*lbuf_hcnt(lb, lbuf_hash(s, len), 1))--;
+	}
+	for (i = 0; i < n_ins; i++) {
+		s = lbuf_text(lb, ins[i], &len);
+		(*lbuf_hcnt(lb, lbuf_hash(s, len), 1))++;
+	}
+}
+
+/* make room for n new blocks after block b */
+static void lbuf_blkins(struct lbuf *lb, int b, int n)
+{
+	if (lb->blk_n + n > lb->blk_sz) {
+		lb->blk_sz = MAX(lb->blk_sz * 2, lb->blk_n + n);
+		lb->blk = erealloc(lb->blk, lb->blk_sz * sizeof(lb->blk[0]));
+		lb->fen = erealloc(lb->fen, (lb->blk_sz + 1) * sizeof(lb->fen[0]));
+		lb->bfen = erealloc(lb->bfen, (lb->blk_sz + 1) * sizeof(lb->bfen[0]));
+	}
+	memmove(lb->blk + b + 1 + n, lb->blk + b + 1,
+		(lb->blk_n - b - 1) * sizeof(lb->blk[0]));
+	for (int i = 0; i < n; i++) {
+		lb->blk[b + 1 + i] = emalloc(sizeof(struct lblk));
+		lb->blk[b + 1 + i]->n = 0;
+		lb->blk[b + 1 + i]->bytes = -1;
+		lb->blk[b + 1 + i]->z = NULL;
+		lb->blk[b + 1 + i]->used = lbuf_tick;
+		lb->blk[b + 1 + i]->pok = 0;
+		lb->blk[b + 1 + i]->shr = 0;
+	}
+	lb->blk_n += n;
+}
+
+/* remove blocks b through e - 1, whose lines the caller takes */
+static void lbuf_blkdel(struct lbuf *lb, int b, int e)
+{
+	for (int i = b; i < e; i++) {
+		struct lblk *k = lb->blk[i];
+		if (k->shr) {
+			k->shr--;
+			for (int j = 0; !k->z && j < k->n; j++)
+				lbuf_lref(k->ln[j]);
+			continue;
+		}
+		free(k->z);
+		free(k);
+	}
+	memmove(lb->blk + b, lb->blk + e, (lb->blk_n - e) * sizeof(lb->blk[0]));
+	lb->blk_n -= e - b;
+}
+
+static void lbuf_pdirty(struct lbuf *lb, int b);
+
+/* replace n_del lines at pos with the n_ins lines in ins */
+static void lbuf_splice(struct lbuf *lb, int pos, int n_del, char **ins, int n_ins)
+{
+	struct lblk *k;
+	int b, e, off, n, rest, fill = LB_MAX * 3 / 4;
+	long d, d2 = 0;
+	if (lb->hash)
+		lbuf_hashsplice(lb, pos, n_del, ins, n_ins);
+	if (n_del) {
+		b = lbuf_blk(lb, pos, &off);
+		k = lbuf_kw(lb, b);
+		n = MIN(n_del, k->n - off);
+		d = lbuf_bytes(lb, k->ln + off, n);
+		memmove(k->ln + off, k->ln + off + n, (k->n - off - n) * sizeof(k->ln[0]));
+		k->n -= n;
+		lbuf_pdirty(lb, b);
+		for (e = b + 1, rest = n_del - n; rest && lb->blk[e]->n <= rest; e++)
+			rest -= lb->blk[e]->n;
+		if (rest) {
+			k = lbuf_kw(lb, e);
+			d2 = lbuf_bytes(lb, k->ln, rest);
+			memmove(k->ln, k->ln + rest, (k->n - rest) * sizeof(k->ln[0]));
+			k->n -= rest;
+			lbuf_pdirty(lb, e);
+			lbuf_bfenadd(lb, e, -d2);
+		}
+		lbuf_bfenadd(lb, b, -d);
+		int s = lb->blk[b]->n ? b + 1 : b, fix = s < e;
+		lbuf_blkdel(lb, s, e);
+		/* merge small neighbours left around the deleted range */
+		if (s > 0 && s < lb->blk_n &&
+				lb->blk[s - 1]->n + lb->blk[s]->n <= LB_MAX / 2) {
+			lbuf_k(lb, s);
+			k = lbuf_kw(lb, s - 1);
+			memcpy(k->ln + k->n, lb->blk[s]->ln, lb->blk[s]->n * sizeof(k->ln[0]));
+			k->n += lb->blk[s]->n;
+			k->pok = 0;
+			k->bytes = k->bytes < 0 || lb->blk[s]->bytes < 0 ?
+				-1 : k->bytes + lb->blk[s]->bytes;
+			lbuf_blkdel(lb, s, s + 1);
+			fix = 1;
+		}
+		if (fix)
+			lbuf_fenmake(lb);
+		else {
+			lbuf_fenadd(lb, b, -n);
+			if (rest)
+				lbuf_fenadd(lb, b + 1, -rest);
+		}
+		lb->ln_n -= n_del;
+	}
+	if (!n_ins)
+		return;
+	if (!lb->blk_n) {
+		lbuf_blkins(lb, -1, 1);
+		lbuf_fenmake(lb);
+	}
+	if (pos == lb->ln_n) {
+		b = lb->blk_n - 1;
+		off = lb->blk[b]->n;
+	} else
+		b = lbuf_blk(lb, pos, &off);
+	k = lbuf_kw(lb, b);
+	lb->ln_n += n_ins;
+	if (k->n + n_ins <= LB_MAX) {
+		memmove(k->ln + off + n_ins, k->ln + off, (k->n - off) * sizeof(k->ln[0]));
+		memcpy(k->ln + off, ins, n_ins * sizeof(k->ln[0]));
+		k->n += n_ins;
+		lbuf_pdirty(lb, b);
+		lbuf_fenadd(lb, b, n_ins);
+		lbuf_bfenadd(lb, b, lbuf_bytes(lb, ins, n_ins));
+		return;
+	}
+	/* split: the new lines and the tail of block b fill new blocks */
+	char *tail[LB_MAX];
+	int tn = k->n - off, r = MAX(0, fill - off), i = 0;
+	memcpy(tail, k->ln + off, tn * sizeof(tail[0]));
+	k->n = off;
+	k->bytes = -1;
+	k->pok = 0;
+	n = n_ins + tn;
+	lbuf_blkins(lb, b, (n - r + fill - 1) / fill);
+	for (e = b; i < n; e++, r = fill)
+		for (k = lb->blk[e], r += k->n; k->n < r && i < n; i++)
+			k->ln[k->n++] = i < n_ins ? ins[i] : tail[i - n_ins];
+	lbuf_fenmake(lb);
+}
+
+/* record size class, or -1 for records allocated on their own */
+#define la_cls(len)	((len) + 4 + (int)sizeof(struct linfo) < LA_CLS * 16 ? \
+			((len) + 4 + (int)sizeof(struct linfo)) / 16 : -1)
+
+/* chunks are aligned to their size and count their records after the
+link to the next chunk, so that empty ones can be given back */
+#define la_base(p)	((char*)((size_t)(p) & ~(size_t)(LA_CHUNK - 1)))
+#define la_live(p)	(((int*)la_base(p))[2])
+
+/* a new chunk, or NULL; MAP_ANONYMOUS is not in POSIX.1-2008 */
+static char *la_chunk(void)
+{
+	static int zfd = -1;
+	if (zfd < 0 && (zfd = open("/dev/zero", O_RDWR | O_CLOEXEC)) < 0)
+		return NULL;
+	char *p = mmap(NULL, LA_CHUNK * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE, zfd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	size_t a = -(size_t)p & (LA_CHUNK - 1);
+	if (a)
+		munmap(p, a);
+	munmap(p + a + LA_CHUNK, LA_CHUNK - a);
+	return p + a;
+}
+
+/* unmap the chunks without records, except the one still being filled */
+static void la_trim(struct larena *la)
+{
+	char **p, *c;
+	for (int i = 0; i < LA_CLS; i++)
+		for (p = &la->free[i]; *p;)
+			if (!la_live(*p) && la_base(*p) != la->chunk)
+				*p = *(char**)*p;
+			else
+				p = (char**)*p;
+	for (p = la->chunk ? (char**)la->chunk : NULL; p && (c = *p);)
+		if (!la_live(c)) {
+			*p = *(char**)c;
+			munmap(c, LA_CHUNK);
+		} else
+			p = (char**)c;
+}
+
+static void *la_alloc(struct larena *la, int c)
+{
+	char *p = la->free[c];
+	if (p) {
+		la->free[c] = *(char**)p;
+		la_live(p)++;
+		return p;
+	}
+	if (la->end - la->cur < (c + 1) * 16) {
+		if (!(p = la_chunk()))
+			return NULL;
+		*(char**)p = la->chunk;
+		la->chunk = p;
+		la->cur = p + 16;
+		la->end = p + LA_CHUNK;
+	}
+	p = la->cur;
+	la->cur += (c + 1) * 16;
+	la_live(p)++;
+	return p;
+}
+
+/* records interned while xil is set are shared by all lbufs, which
+count their users in ref; the table is open addressed by line hash */
+struct lint {
+	char *ln;			/* interned record or NULL */
+	unsigned h;			/* its hash */
+};
+static struct {
+	struct lint *t;			/* the table */
+	int sz, n;			/* table size and records in it */
+	struct larena la;		/* interned record allocator */
+} lbuf_il;
+
+/* remove an interned record, moving back the ones probed past it */
+static void lbuf_unintern(char *ln)
+{
+	unsigned m = lbuf_il.sz - 1, i = lbuf_hash(ln, lbuf_s(ln)->len) & m, j;
+	while (lbuf_il.t[i].ln != ln)
+		i = (i + 1) & m;
+	for (j = (i + 1) & m; lbuf_il.t[j].ln; j = (j + 1) & m)
+		if (((j - lbuf_il.t[j].h) & m) >= ((j - i) & m)) {
+			lbuf_il.t[i] = lbuf_il.t[j];
+			i = j;
+		}
+	lbuf_il.t[i].ln = NULL;
+	lbuf_il.n--;
+}
+
+static void la_free(struct larena *la, struct linfo *n)
+{
+	int c = la_cls(n->len);
+	struct lbig *b = (struct lbig*)n - 1, *g;
+	if (c >= 0 && la->nbigcls) {	/* made when no chunk could be mapped? */
+		for (g = la->big; g && g != b; g = g->next);
+		if (g) {
+			la->nbigcls--;
+			c = -1;
+		}
+	}
+	if (c >= 0) {
+		*(char**)n = la->free[c];
+		la->free[c] = (char*)n;
+		la_live(n)--;
+		return;
+	}
+	if (b->next)
+		b->next->prev = b->prev;
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		la->big = b->next;
+	free(b);
+}
+
+static void lbuf_lfree(struct lbuf *lb, char *ln)
+{
+	if (lbuf_tagged(ln))
+		return;
+	struct linfo *n = lbuf_s(ln);
+	struct larena *la = &lbuf_il.la;
+	if (!n->ref)
+		la = &lb->la;
+	else if (n->ref < 0) {
+		n->ref++;
+		return;
+	} else if (--n->ref)
+		return;
+	else
+		lbuf_unintern(ln);
+	la_free(la, n);
+}
+
+/* add a user to a line record */
+static void lbuf_lref(char *ln)
+{
+	if (!lbuf_tagged(ln))
+		lbuf_s(ln)->ref += lbuf_s(ln)->ref > 0 ? 1 : -1;
+}
+
+static void lopt_done(struct lbuf *lb, struct lopt *lo)
+{
+	lb->hist_mem -= lo->mem;
 	free(lo->mark);
 	if (!(lo->ref & 2))
 		for (int i = 0; i < lo->n_ins; i++)
-			free(lbuf_s(lo->ins[i]));
+			lbuf_lfree(lb, lo->ins[i]);
 	free(lo->ins);
-	if (!(lo->ref & 1))
+	if (!(lo->ref & 5))
 		for (int i = 0; i < lo->n_del; i++)
-			free(lbuf_s(lo->del[i]));
+			lbuf_lfree(lb, lo->del[i]);
 	free(lo->del);
 }
 
@@ -76,191 +627,1359 @@ int lbuf_jump(struct lbuf *lb, int mk, int *pos, int *off)
 	return 0;
 }
 
+/* remove the undo journal */
+void lbuf_jclose(struct lbuf *lb)
+{
+	if (lb->jfd < 0)
+		return;
+	close(lb->jfd);
+	unlink(lb->jpath);
+	if (lb->jsb)
+		sbuf_free(lb->jsb)
+	lb->jsb = NULL;
+	lb->jfd = -1;
+}
+
 void lbuf_free(struct lbuf *lb)
 {
-	int i;
-	for (i = 0; i < lb->ln_n; i++)
-		free(lbuf_i(lb, i));
-	for (i = 0; i < lb->hist_n; i++)
-		lopt_done(&lb->hist[i]);
+	int i, j;
+	char *c;
+	struct lbig *b;
+	if (lbuf_bg.lb == lb)
+		lbuf_ldend(&lbuf_bg, 1);
+	while (lb->chk_n)
+		lbuf_chkdel(lb, lb->chk_n - 1);
+	free(lb->chk);
+	for (i = 0; i < lb->hist_n; i++) {
+		if (lbuf_il.n) {	/* interned records outlive the arena */
+			lopt_done(lb, &lb->hist[i]);
+			continue;
+		}
+		free(lb->hist[i].mark);		/* records go with the arena */
+		free(lb->hist[i].ins);
+		free(lb->hist[i].del);
+	}
+	for (i = 0; lbuf_il.n && i < lb->blk_n; i++)
+		for (j = 0; !lb->blk[i]->z && j < lb->blk[i]->n; j++)
+			lbuf_lfree(lb, lb->blk[i]->ln[j]);
+	lbuf_jclose(lb);
+	free(lb->jpath);
+	free(lb->jfile);
+	while ((c = lb->la.chunk)) {
+		lb->la.chunk = *(char**)c;
+		munmap(c, LA_CHUNK);
+	}
+	while ((b = lb->la.big)) {
+		lb->la.big = b->next;
+		free(b);
+	}
+	for (i = 0; i < lb->map_n; i++)
+		munmap(lb->map[i].s, lb->map[i].sz);
+	free(lb->map);
 	free(lb->hist);
 	free(lb->mark);
-	free(lb->ln);
+	lbuf_blkdel(lb, 0, lb->blk_n);
+	free(lb->blk);
+	free(lb->fen);
+	free(lb->bfen);
+	free(lb->ptree);
+	free(lb->hash);
 	free(lb);
 }
 
-static int linelength(char *s)
+static int linelength(char *s)
+{
+	int len = dstrlen(s, '\n');
+	return s[len] == '\n' ? len + 1 : len;
+}
+
+/* allocate a line record of len bytes for the caller to fill */
+static char *lbuf_lalloc(struct larena *la, int len)
+{
+	struct linfo *n;
+	int c = la_cls(len);
+	if (c < 0 || !(n = la_alloc(la, c))) {
+		la->nbigcls += c >= 0;
+		struct lbig *b = emalloc(sizeof(*b) + len + 5 + sizeof(*n));
+		b->prev = NULL;
+		b->next = la->big;
+		if (b->next)
+			b->next->prev = b;
+		la->big = b;
+		n = (struct linfo*)(b + 1);
+	}
+	n->len = len;
+	n->grec = 0;
+	n->ref = 0;
+	char *ln = (char*)(n + 1);
+	memset(&ln[len + 1], 0, 4);	/* fault tolerance pad */
+	ln[len] = '\n';
+	return ln;
+}
+
+static void lbuf_lnchr(char *ln)
+{
+	unsigned char a = 0;
+	int len = lbuf_s(ln)->len;
+	for (int i = 0; i < len; i++)
+		a |= ln[i];
+	lbuf_s(ln)->nchr = a & 0x80 ? -1 : len + 1;
+}
+
+/* the interned record holding len bytes of s */
+static char *lbuf_intern(char *s, int len)
+{
+	unsigned h = lbuf_hash(s, len), m, i;
+	char *ln;
+	if (lbuf_il.n * 2 >= lbuf_il.sz) {
+		struct lint *t = lbuf_il.t;
+		int sz = lbuf_il.sz;
+		lbuf_il.sz = sz ? sz * 2 : 1024;
+		lbuf_il.t = emalloc(lbuf_il.sz * sizeof(t[0]));
+		memset(lbuf_il.t, 0, lbuf_il.sz * sizeof(t[0]));
+		m = lbuf_il.sz - 1;
+		for (int j = 0; j < sz; j++) {
+			if (!t[j].ln)
+				continue;
+			for (i = t[j].h & m; lbuf_il.t[i].ln; i = (i + 1) & m);
+			lbuf_il.t[i] = t[j];
+		}
+		free(t);
+	}
+	m = lbuf_il.sz - 1;
+	for (i = h & m; (ln = lbuf_il.t[i].ln); i = (i + 1) & m)
+		if (lbuf_il.t[i].h == h && lbuf_s(ln)->len == len && !memcmp(ln, s, len)) {
+			lbuf_s(ln)->ref++;
+			return ln;
+		}
+	ln = lbuf_lalloc(&lbuf_il.la, len);
+	memcpy(ln, s, len);
+	lbuf_lnchr(ln);
+	lbuf_s(ln)->ref = 1;
+	lbuf_il.t[i].ln = ln;
+	lbuf_il.t[i].h = h;
+	lbuf_il.n++;
+	return ln;
+}
+
+/* allocate a line record holding len bytes of s */
+static char *lbuf_line(struct lbuf *lb, char *s, int len)
+{
+	if (xil)
+		return lbuf_intern(s, len);
+	char *ln = lbuf_lalloc(&lb->la, len);
+	memcpy(ln, s, len);
+	lbuf_lnchr(ln);
+	return ln;
+}
+
+/* a delta record (nchr of LD_NCHR) keeps a history line as the lengths
+of the prefix and suffix it shares with its replacement, and the rest */
+#define LD_NCHR		-2
+#define LD_MIN		32	/* shared bytes that make a delta worthwhile */
+
+/* turn the n records of ln into deltas against lines to, or back */
+static void lbuf_delta(struct lbuf *lb, char **ln, char **to, int n, int pack)
+{
+	int i, len, tlen, m, d[2];
+	char *s, *t, *r;
+	for (i = 0; i < n; i++) {
+		if (lbuf_tagged(ln[i]) || (lbuf_s(ln[i])->nchr == LD_NCHR) != !pack)
+			continue;
+		s = ln[i];
+		len = lbuf_s(s)->len;
+		t = lbuf_text(lb, to[i], &tlen);
+		if (!pack) {
+			memcpy(d, s, sizeof(d));
+			d[0] = MIN(d[0], tlen);		/* lbuf changed without history */
+			d[1] = MIN(d[1], tlen - d[0]);
+			len -= sizeof(d);
+			r = lbuf_lalloc(&lb->la, d[0] + len + d[1]);
+			memcpy(r, t, d[0]);
+			memcpy(r + d[0], s + sizeof(d), len);
+			memcpy(r + d[0] + len, t + tlen - d[1], d[1]);
+			lbuf_lnchr(r);
+		} else {
+			m = MIN(len, tlen);
+			for (d[0] = 0; d[0] + 8 <= m && !memcmp(s + d[0], t + d[0], 8); d[0] += 8);
+			for (; d[0] < m && s[d[0]] == t[d[0]]; d[0]++);
+			m -= d[0];
+			for (d[1] = 0; d[1] + 8 <= m && !memcmp(s + len - d[1] - 8,
+				t + tlen - d[1] - 8, 8); d[1] += 8);
+			for (; d[1] < m && s[len - d[1] - 1] == t[tlen - d[1] - 1]; d[1]++);
+			if (d[0] + d[1] < LD_MIN)
+				continue;
+			len -= d[0] + d[1];
+			r = lbuf_lalloc(&lb->la, sizeof(d) + len);
+			memcpy(r, d, sizeof(d));
+			memcpy(r + sizeof(d), s + d[0], len);
+			lbuf_s(r)->nchr = LD_NCHR;
+		}
+		lbuf_s(r)->grec = lbuf_s(s)->grec;
+		lbuf_lfree(lb, s);
+		ln[i] = r;
+	}
+}
+
+/* copy a mapped line into a private record */
+static char *lbuf_untag(struct lbuf *lb, char *ln)
+{
+	int len;
+	char *s = lbuf_text(lb, ln, &len);
+	return lbuf_line(lb, s, len);
+}
+
+/* the text of line pos without copying it out of a mapping */
+static char *lbuf_raw(struct lbuf *lb, int pos, int *len)
+{
+	return lbuf_text(lb, *lbuf_ln(lb, pos), len);
+}
+
+/* update mark m for lo replacing n_del lines with n_ins */
+static void lopt_mark(struct lopt *lo, int *m, int n_del, int n_ins)
+{
+	int pos = lo->pos, *lm;
+	if (m[1] >= pos + n_ins && m[1] < pos + n_del) {
+		mark_set(&lo->mark, &lo->mark_n, m[0], m[1], m[2]);
+		m[1] = n_ins ? pos + n_ins - 1 : -1;
+	} else if (m[1] >= pos + n_del) {
+		m[1] += n_ins - n_del;
+	} else if ((lm = mark_find(lo->mark, lo->mark_n, m[0])))
+		lbuf_copymark((m + 1), lm)
+}
+
+/* low-level line replacement */
+static int lbuf_replace(struct lbuf *lb, sbuf *sb, char *s, struct lopt *lo, int n_del, int n_ins)
+{
+	int i, pos = lo->pos;
+	if (s) {
+		for (; *s; n_ins++) {
+			int l = linelength(s);
+			char *ln = lbuf_line(lb, s, l - (s[l - !!l] == '\n'));
+			sbuf_mem(sb, &ln, sizeof(s))
+			s += l;
+		}
+	}
+	lbuf_splice(lb, pos, n_del, (char**)sb->s, n_ins);
+	for (i = 0; i < lb->mark_n; i++)	/* updating marks */
+		lopt_mark(lo, lb->mark + i * 3, n_del, n_ins);
+	return n_ins;
+}
+
+void lbuf_smark(struct lbuf *lb, struct lopt *lo, int beg, int o1)
+{
+	lbuf_copymark(lo->mark_sb, lb->mark_sb)
+	lb->mark_sb[0] = beg;
+	lb->mark_sb[1] = o1;
+}
+
+void lbuf_emark(struct lbuf *lb, struct lopt *lo, int end, int o2)
+{
+	lbuf_copymark(lo->mark_se, lb->mark_se)
+	lb->mark_se[0] = end;
+	lb->mark_se[1] = o2;
+	if (xseq < 0)
+		lopt_done(lb, lo);
+}
+
+/*
+ * Checkpoints keep the lines of lbuf at some history positions, by
+ * sharing its blocks; lbuf_kw() copies a shared block before lbuf
+ * changes it.  Jumping to a checkpoint saves replaying the ops in
+ * between, which keep the side they held: ops past hist_u may still
+ * hold their deleted lines and ops before it their inserted ones.
+ * Such ops are replayed from the checkpoint next to them when needed,
+ * so a checkpoint bounding them is kept (see lbuf_chkneed()).
+ */
+static void lbuf_chkdel(struct lbuf *lb, int i)
+{
+	struct lchk *c = &lb->chk[i];
+	for (int j = 0; j < c->blk_n; j++)
+		lbuf_kput(lb, c->blk[j]);
+	free(c->blk);
+	memmove(c, c + 1, (--lb->chk_n - i) * sizeof(*c));
+}
+
+/* checkpoint the lines of lbuf at hist_u, returning its index */
+static int lbuf_chkadd(struct lbuf *lb)
+{
+	struct lchk *c;
+	int i = 0;
+	while (i < lb->chk_n && lb->chk[i].h < lb->hist_u)
+		i++;
+	if (i < lb->chk_n && lb->chk[i].h == lb->hist_u)
+		return i;
+	if (lb->chk_n == lb->chk_sz) {
+		lb->chk_sz = lb->chk_sz ? lb->chk_sz * 2 : 8;
+		lb->chk = erealloc(lb->chk, lb->chk_sz * sizeof(lb->chk[0]));
+	}
+	c = &lb->chk[i];
+	memmove(c + 1, c, (lb->chk_n++ - i) * sizeof(*c));
+	c->blk = emalloc((lb->blk_n + 1) * sizeof(c->blk[0]));
+	for (int j = 0; j < lb->blk_n; j++)
+		(c->blk[j] = lb->blk[j])->shr++;
+	c->blk_n = lb->blk_n;
+	c->ln_n = lb->ln_n;
+	c->h = lb->hist_u;
+	lb->chk_work = 0;
+	return i;
+}
+
+/* whether ops holding the side on lbuf start or end at checkpoint i */
+static int lbuf_chkneed(struct lbuf *lb, int i)
+{
+	int h = lb->chk[i].h;
+	if (h < lb->hist_u)
+		return !(lb->hist[h].ref & 2);
+	return h > lb->hist_u && lb->hist[h - 1].ref & 2;
+}
+
+/* checkpoint lbuf once it changed more lines than it holds, so the
+blocks copied after sharing them cost a step per changed line; the
+oldest checkpoints not needed are dropped to keep xhc of them */
+static void lbuf_chkauto(struct lbuf *lb)
+{
+	int add = xhc > 0 && lb->chk_work >= LB_MAX + lb->ln_n;
+	for (int i = 0; i < lb->chk_n && lb->chk_n > xhc - add;)
+		if (lbuf_chkneed(lb, i))
+			i++;
+		else
+			lbuf_chkdel(lb, i);
+	if (add && lb->chk_n < xhc)
+		lbuf_chkadd(lb);
+}
+
+static void lbuf_jhead(struct lbuf *lb);
+
+static void lbuf_histfree(struct lbuf *lb)
+{
+	while (lb->chk_n)
+		lbuf_chkdel(lb, lb->chk_n - 1);
+	lb->chk_work = 0;
+	for (int i = 0; i < lb->hist_n; i++)
+		lopt_done(lb, &lb->hist[i]);
+	lb->hist_n = 0;
+	lb->hist_u = 0;
+	lb->hist_mem = 0;
+	lb->hist_j = 0;
+	if (lb->jsb && !ftruncate(lb->jfd, 0)) {
+		sbuf_cut(lb->jsb, 0)
+		lb->jend = 0;
+		lb->jsaved = 0;
+		lbuf_jhead(lb);
+	}
+	lb->wsaved = -1;
+}
+
+/* append undo/redo history */
+struct lopt *lbuf_opt(struct lbuf *lb, int beg, int o1, int n_del)
+{
+	struct lopt *lo;
+	static struct lopt slo;
+	if (lb->wsaved > lb->hist_u || xseq < 0)
+		lb->wsaved = -1;	/* the pending write is not in history */
+	if (xseq < 0) {
+		lo = &slo;
+		/* positions in history no longer match lbuf */
+		if (lb->hist_n) {
+			lbuf_histfree(lb);
+			lb->saved = -1;
+		}
+	} else {
+		for (int i = lb->hist_u; i < lb->hist_n; i++)
+			lopt_done(lb, &lb->hist[i]);
+		lb->hist_n = lb->hist_u;
+		while (lb->chk_n && lb->chk[lb->chk_n - 1].h > lb->hist_u)
+			lbuf_chkdel(lb, lb->chk_n - 1);
+		if (lb->hist_n && lb->hist[lb->hist_n - 1].seq != lb->useq)
+			lbuf_chkauto(lb);
+		if (lb->hist_n == lb->hist_sz) {
+			int sz = lb->hist_sz + (lb->hist_sz ? lb->hist_sz : 128);
+			struct lopt *hist = emalloc(sz * sizeof(hist[0]));
+			memcpy(hist, lb->hist, lb->hist_n * sizeof(hist[0]));
+			free(lb->hist);
+			lb->hist = hist;
+			lb->hist_sz = sz;
+		}
+		lo = &lb->hist[lb->hist_n++];
+		lb->hist_u = lb->hist_n;
+	}
+	lo->ins = NULL;
+	lo->del = n_del ? emalloc(n_del * sizeof(lo->del[0])) : NULL;
+	for (int i = 0; i < n_del; i++)
+		lo->del[i] = *lbuf_ln(lb, beg + i);
+	lo->mark = NULL;
+	lo->mark_n = 0;
+	lo->mark_sb[0] = -1;
+	lo->mark_se[0] = -1;
+	lo->pos = beg;
+	lo->pos_off = o1;
+	lo->n_ins = 0;
+	lo->n_del = n_del;
+	lo->seq = lb->useq;
+	lo->ref = 2;
+	lo->mem = 0;
+	lo->jo = -1;
+	return lo;
+}
+
+/* update the memory held by the side of lo that is off lbuf */
+static void lopt_size(struct lbuf *lb, struct lopt *lo)
+{
+	char **ln = lo->ref & 2 ? lo->del : lo->ins;
+	int n = lo->ref & 4 ? 0 : lo->ref & 2 ? lo->n_del : lo->n_ins;
+	long sz = sizeof(*lo) + n * sizeof(ln[0]);
+	for (int i = 0; i < n; i++)
+		if (!lbuf_tagged(ln[i]))
+			sz += lbuf_s(ln[i])->len + sizeof(struct linfo) + 5;
+	lb->hist_mem += sz - lo->mem;
+	lo->mem = sz;
+}
+
+/* drop the oldest undo sequences while history is over xhm MiB,
+never leaving part of a run of ops applied by a checkpoint jump, as
+undoing the rest needs the checkpoint at its start */
+static void lbuf_histcap(struct lbuf *lb)
+{
+	long mem = lb->hist_mem;
+	int n = 0, seq, i;
+	while (xhm > 0 && mem > (long)xhm << 20 && n < lb->hist_u
+			&& lb->hist[n].seq != lb->hist[lb->hist_u - 1].seq)
+		for (seq = lb->hist[n].seq; n < lb->hist_u && lb->hist[n].seq == seq; n++)
+			mem -= lb->hist[n].mem;
+	while (n && n < lb->hist_u && !(lb->hist[n].ref & 2)
+			&& !(lb->hist[n - 1].ref & 2)) {
+		while (n && !(lb->hist[n - 1].ref & 2))
+			n--;
+		while (n && lb->hist[n - 1].seq == lb->hist[n].seq)
+			n--;
+	}
+	for (i = 0; i < n; i++)
+		lopt_done(lb, &lb->hist[i]);
+	if (!n)
+		return;
+	while (lb->chk_n && lb->chk[0].h < n)
+		lbuf_chkdel(lb, 0);
+	for (i = 0; i < lb->chk_n; i++)
+		lb->chk[i].h -= n;
+	memmove(lb->hist, lb->hist + n, (lb->hist_n - n) * sizeof(lb->hist[0]));
+	lb->hist_n -= n;
+	lb->hist_u -= n;
+	lb->hist_j = MAX(0, lb->hist_j - n);
+	lb->saved = lb->saved < n ? -1 : lb->saved - n;
+	lb->wsaved = lb->wsaved < n ? -1 : lb->wsaved - n;
+}
+
+/*
+ * The undo journal appends a record for each edit kept in history and
+ * for each undo or redo of one:
+ *	long long kind ('e' edit, 'u' undo, 'r' redo), seq, pos, n_del, n_ins
+ *	long long bytes of the deleted lines that follow
+ *	deleted lines, then inserted lines, each as an int length and text
+ * Undo and redo records have no lines. An 'f' record starts the journal
+ * and follows each read or write of the file:
+ *	long long 'f', journal offset the file is current to, file size,
+ *	mtime, 0, path length, then the path
+ * After a crash, replaying the records past the offset of the last 'f'
+ * record matching the file restores the buffer. Deleted lines of old
+ * edits are dropped from memory and read back when undone.
+ */
+#define lbuf_jsize(lb) (lb->jend + (lb->jsb ? lb->jsb->s_n : 0))
+
+/* write out the journal buffer if full or if flush */
+static void lbuf_jput(struct lbuf *lb, int flush)
+{
+	sbuf *sb = lb->jsb;
+	if (!sb || (!flush && sb->s_n < 1 << 16) || !sb->s_n)
+		return;
+	if (pwrite(lb->jfd, sb->s, sb->s_n, lb->jend) != sb->s_n) {
+		/* stop journaling; what was written can still be read */
+		for (int i = 0; i < lb->hist_n; i++)
+			if (lb->hist[i].jo >= lb->jend)
+				lb->hist[i].jo = -1;
+		sbuf_free(lb->jsb)
+		lb->jsb = NULL;
+		return;
+	}
+	lb->jend += sb->s_n;
+	sbuf_cut(sb, 0)
+}
+
+/* append the 'f' record of the file to the journal */
+static void lbuf_jhead(struct lbuf *lb)
+{
+	long long h[6] = {'f', lb->jsaved, lb->jfsz, lb->jfmtime, 0, 0};
+	if (!lb->jsb)
+		return;
+	h[5] = lb->jfile ? strlen(lb->jfile) : 0;
+	sbuf_mem(lb->jsb, h, sizeof(h))
+	sbuf_mem(lb->jsb, lb->jfile, h[5])
+	lbuf_jput(lb, 0);
+}
+
+/* note the file of lb, as of its last read or write */
+void lbuf_jfile(struct lbuf *lb, char *path, long long sz, long long mtime)
+{
+	free(lb->jfile);
+	lb->jfile = *path ? uc_dup(path) : NULL;
+	lb->jfsz = sz;
+	lb->jfmtime = mtime;
+	lbuf_jhead(lb);
+}
+
+static void lbuf_jlines(struct lbuf *lb, char **ln, int n)
+{
+	int len;
+	char *s;
+	for (int i = 0; i < n && lb->jsb; i++) {
+		s = lbuf_text(lb, ln[i], &len);
+		sbuf_mem(lb->jsb, &len, sizeof(len))
+		sbuf_mem(lb->jsb, s, len)
+		lbuf_jput(lb, 0);
+	}
+}
+
+/* append the edit or undo/redo (kind) of lo to the journal */
+static void lbuf_jlog(struct lbuf *lb, struct lopt *lo, int kind, char **ins)
+{
+	long long h[6] = {kind, lo->seq, lo->pos, 0, 0, 0};
+	if (lb->jfd < 0 && xhj > 0 && kind == 'e' && !lb->jpath) {
+		char *tmp = getenv("TMPDIR");
+		lb->jpath = emalloc(strlen(tmp ? tmp : "/tmp") + 16);
+		sprintf(lb->jpath, "%s/nextvi.XXXXXX", tmp ? tmp : "/tmp");
+		if ((lb->jfd = mkstemp(lb->jpath)) < 0)
+			return;		/* jpath stays set, so it is not retried */
+		sbuf_make(lb->jsb, 1 << 12)
+		lb->jend = 0;
+		lbuf_jhead(lb);
+	}
+	if (!lb->jsb)
+		return;
+	if (kind == 'e') {
+		h[3] = lo->n_del;
+		h[4] = lo->n_ins;
+		h[5] = lbuf_bytes(lb, lo->del, lo->n_del) + lo->n_del * (long long)(sizeof(int) - 1);
+		lo->jo = lbuf_jsize(lb);
+	}
+	sbuf_mem(lb->jsb, h, sizeof(h))
+	if (kind == 'e') {	/* the lines are written in full, before delta */
+		lbuf_jlines(lb, lo->del, lo->n_del);
+		lbuf_jlines(lb, ins, lo->n_ins);
+	}
+	lbuf_jput(lb, 0);
+}
+
+/* drop the deleted lines of old edits that are in the journal */
+static void lbuf_jspill(struct lbuf *lb)
+{
+	struct lopt *lo;
+	int i, seq = lb->hist_u ? lb->hist[lb->hist_u - 1].seq : 0;
+	if (lb->jfd < 0 || xhj <= 0 || lb->hist_mem <= (long)xhj << 20)
+		return;
+	for (; lb->hist_j < lb->hist_u && lb->hist_mem > (long)xhj << 20; lb->hist_j++) {
+		lo = &lb->hist[lb->hist_j];
+		if (lo->seq == seq)
+			break;
+		if (lo->jo >= lb->jend)
+			lbuf_jput(lb, 1);
+		if (lo->jo < 0 || lo->jo >= lb->jend || lo->ref != 2 || !lo->n_del)
+			continue;
+		for (i = 0; i < lo->n_del; i++)
+			lbuf_lfree(lb, lo->del[i]);
+		free(lo->del);
+		lo->del = NULL;
+		lo->ref |= 4;
+		lopt_size(lb, lo);
+	}
+}
+
+/* read the deleted lines of lo back from the journal */
+static int lbuf_jload(struct lbuf *lb, struct lopt *lo)
+{
+	long long h[6], n;
+	ssize_t nr = 0;
+	int i, len;
+	char *s, *p;
+	if (!(lo->ref & 4))
+		return 0;
+	lbuf_jput(lb, 1);
+	if (lb->jfd < 0 || pread(lb->jfd, h, sizeof(h), lo->jo) != sizeof(h))
+		return 1;
+	s = emalloc(h[5]);
+	for (n = 0; n < h[5]; n += nr)	/* reads may return less */
+		if ((nr = pread(lb->jfd, s + n, h[5] - n, lo->jo + sizeof(h) + n)) <= 0)
+			break;
+	if (n < h[5]) {
+		free(s);
+		return 1;
+	}
+	lo->del = emalloc(lo->n_del * sizeof(lo->del[0]));
+	for (i = 0, p = s; i < lo->n_del; i++) {
+		memcpy(&len, p, sizeof(len));
+		lo->del[i] = lbuf_line(lb, p + sizeof(len), len);
+		p += sizeof(len) + len;
+	}
+	free(s);
+	lo->ref &= ~4;
+	return 0;
+}
+
+/* the n lines from pos, as they are on lbuf now */
+static char **lbuf_lns(struct lbuf *lb, int pos, int n)
+{
+	char **ln = n ? emalloc(n * sizeof(ln[0])) : NULL;
+	for (int i = 0; i < n; i++)
+		ln[i] = *lbuf_ln(lb, pos + i);
+	return ln;
+}
+
+/* undo or redo the n ops of a seq starting at hist[h] at once: each
+op changing lines must start after the lines inserted by the previous
+one, otherwise 1 is returned */
+static int lbuf_bulk(struct lbuf *lb, int h, int n, int undo)
+{
+	struct lopt *lo = lb->hist + h, *o;
+	char *tmp[LB_MAX], **ln;
+	int i, j, k, l, m = 0, d = 0;
+	for (i = 0, j = -1; i < n; i++) {
+		if (!lo[i].n_del && !lo[i].n_ins)	/* only holds cursor marks */
+			continue;
+		if (j >= 0 && lo[i].pos < lo[j].pos + lo[j].n_ins)
+			return 1;
+		j = i;
+		m++;
+	}
+	/* for ops changing lines, x: index, r: start on lbuf now,
+	c: lines there, f: start afterwards, w: lines afterwards */
+	int *x = emalloc(m * 5 * sizeof(x[0]) + 1), *r = x + m, *c = r + m,
+		*f = c + m, *w = f + m;
+	for (i = 0, j = 0; i < n; i++) {
+		if (!lo[i].n_del && !lo[i].n_ins)
+			continue;
+		x[j] = i;
+		r[j] = undo ? lo[i].pos : lo[i].pos - d;
+		f[j] = undo ? lo[i].pos - d : lo[i].pos;
+		c[j] = undo ? lo[i].n_ins : lo[i].n_del;
+		w[j] = undo ? lo[i].n_del : lo[i].n_ins;
+		d += lo[i].n_ins - lo[i].n_del;
+		j++;
+	}
+	for (i = undo ? n - 1 : 0, j = undo ? m - 1 : 0; i >= 0 && i < n; i += undo ? -1 : 1) {
+		o = &lo[i];
+		lbuf_jlog(lb, o, undo ? 'u' : 'r', NULL);
+		o->ref = undo ? 1 : 2;
+		if (!o->n_del && !o->n_ins)
+			continue;
+		ln = lbuf_lns(lb, r[j], c[j]);
+		*(undo ? &o->ins : &o->del) = ln;
+		lbuf_delta(lb, undo ? o->del : o->ins, ln, MIN(c[j], w[j]), 0);
+		j += undo ? -1 : 1;
+	}
+	/* one splice per run of ops spanning at most a block, last run
+	first; runs take few lines between ops, as splices measure them */
+	for (l = m - 1; l >= 0; l = k - 1) {
+		for (k = l; k > 0 && r[l] + c[l] - r[k - 1] <= LB_MAX &&
+				f[l] + w[l] - f[k - 1] <= LB_MAX &&
+				r[k] - r[k - 1] - c[k - 1] <= LB_MAX / 64; k--);
+		ln = undo ? lo[x[l]].del : lo[x[l]].ins;
+		if (k < l) {
+			for (i = k, j = 0; i <= l; i++) {
+				memcpy(tmp + j, undo ? lo[x[i]].del : lo[x[i]].ins,
+					w[i] * sizeof(tmp[0]));
+				j += w[i];
+				for (d = r[i] + c[i]; i < l && d < r[i + 1]; d++)
+					tmp[j++] = *lbuf_ln(lb, d);
+			}
+			ln = tmp;
+		}
+		lbuf_splice(lb, r[k], r[l] + c[l] - r[k], ln, f[l] + w[l] - f[k]);
+	}
+	for (i = 0; i < n; i++) {
+		o = &lo[i];
+		if (undo) {
+			lbuf_delta(lb, o->ins, o->del, MIN(o->n_del, o->n_ins), 1);
+			free(o->del);
+			o->del = NULL;
+		} else {
+			lbuf_delta(lb, o->del, o->ins, MIN(o->n_del, o->n_ins), 1);
+			free(o->ins);
+			o->ins = NULL;
+		}
+		lopt_size(lb, o);
+	}
+	/* marks saved by these ops may be restored by them; follow such
+	marks through each op and place the rest with a binary search */
+	char *slow = emalloc(lb->mark_n + 1);
+	int *sm, ns = 0;
+	memset(slow, 0, lb->mark_n);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < lo[i].mark_n * 3; j += 3)
+			if ((sm = mark_find(lb->mark, lb->mark_n, lo[i].mark[j])) &&
+					!slow[(sm - lb->mark) / 3]) {
+				slow[(sm - lb->mark) / 3] = 1;
+				ns++;
+			}
+	for (i = undo ? n - 1 : 0; ns && i >= 0 && i < n; i += undo ? -1 : 1)
+		for (j = 0; j < lb->mark_n; j++)
+			if (slow[j])
+				lopt_mark(&lo[i], lb->mark + j * 3, undo ? lo[i].n_ins :
+					lo[i].n_del, undo ? lo[i].n_del : lo[i].n_ins);
+	for (i = 0; i < lb->mark_n; i++) {	/* updating marks */
+		if (slow[i])
+			continue;
+		int *mk = lb->mark + i * 3, b = 0, e = m;
+		while (b < e) {		/* the first op not ending before the mark */
+			k = (b + e) / 2;
+			if (r[k] + c[k] <= mk[1])
+				b = k + 1;
+			else
+				e = k;
+		}
+		k = b;
+		if (k < m && r[k] <= mk[1]) {
+			if ((d = mk[1] - r[k]) < w[k]) {
+				mk[1] = f[k] + d;
+				continue;
+			}
+			o = &lo[x[k]];
+			mark_set(&o->mark, &o->mark_n, mk[0], o->pos + d, mk[2]);
+			mk[1] = w[k] ? f[k] + w[k] - 1 : -1;
+		} else if (k)
+			mk[1] += f[k - 1] + w[k - 1] - r[k - 1] - c[k - 1];
+	}
+	free(slow);
+	free(x);
+	return 0;
+}
+
+/* replace lines beg through end with buf or n line records in sb */
+static void lbuf_sbedit(struct lbuf *lb, sbuf *sb, char *buf, int n,
+		int beg, int end, int o1, int o2)
+{
+	beg = MIN(beg, lb->ln_n);
+	end = MIN(end, lb->ln_n);
+	struct lopt *lo = lbuf_opt(lb, beg, o1, end - beg);
+	lo->n_ins = lbuf_replace(lb, sb, buf, lo, lo->n_del, n);
+	if (lb->hist_u < 2 || lb->hist[lb->hist_u - 2].seq != lb->useq)
+		lbuf_smark(lb, lo, beg, o1);
+	lbuf_emark(lb, lo, beg + (lo->n_ins ? lo->n_ins - 1 : 0), o2);
+	lb->modified = 1;
+	if (lb->saved > lb->hist_u)
+		lb->saved = -1;
+	if (xseq >= 0) {	/* inserted lines are on lbuf, see lbuf_undo() */
+		lbuf_jlog(lb, lo, 'e', (char**)sb->s);
+		lb->chk_work += lo->n_del + lo->n_ins + 1;
+		lbuf_delta(lb, lo->del, (char**)sb->s, MIN(lo->n_del, lo->n_ins), 1);
+		lopt_size(lb, lo);
+		lbuf_jspill(lb);
+		lbuf_histcap(lb);
+	}
+	free(sb->s);
+}
+
+/* replace lines beg through end with buf */
+void lbuf_edit(struct lbuf *lb, char *buf, int beg, int end, int o1, int o2)
+{
+	if (!buf && MIN(beg, lb->ln_n) == MIN(end, lb->ln_n))
+		return;
+	sbuf_smake(sb, sizeof(char*)+1)
+	lbuf_sbedit(lb, sb, buf, 0, beg, end, o1, o2);
+}
+
+/* move lines beg through end of src before line pos of lb without
+copying them: private records come along with the arena of src,
+interned ones keep their reference and mapped ones their mapping,
+shifted into the tag space of lb; src is left empty for lbuf_free() */
+void lbuf_move(struct lbuf *lb, int pos, struct lbuf *src, int beg, int end)
+{
+	struct larena *a = &lb->la, *b = &src->la;
+	size_t shift = lb->map_end;
+	int i, n, ok = src->map_end <= ((size_t)-1 >> 1) - shift;
+	char **p, *ln;
+	if (lbuf_bg.lb == src)
+		lbuf_ldend(&lbuf_bg, 1);
+	while (src->chk_n)
+		lbuf_chkdel(src, src->chk_n - 1);
+	end = MIN(end, src->ln_n);
+	n = MAX(0, end - beg);
+	sbuf_smake(sb, n * sizeof(char*) + 1)
+	for (i = 0; i < src->ln_n; i++) {
+		ln = *lbuf_ln(src, i);
+		if (i < beg || i >= end)
+			lbuf_lfree(src, ln);
+		else {
+			if (lbuf_tagged(ln))
+				ln = ok ? (char*)(((((size_t)ln >> 1) + shift) << 1) | 1)
+					: lbuf_untag(src, ln);
+			sbuf_mem(sb, &ln, sizeof(ln))
+		}
+	}
+	for (i = 0; i < src->hist_n; i++)
+		lopt_done(src, &src->hist[i]);
+	src->hist_n = 0;
+	src->hist_u = 0;
+	lbuf_blkdel(src, 0, src->blk_n);
+	src->ln_n = 0;
+	/* the chunks of src go after the one lb is filling */
+	if (b->chunk) {
+		for (p = (char**)b->chunk; *p; p = (char**)*p);
+		if (a->chunk) {
+			*p = *(char**)a->chunk;
+			*(char**)a->chunk = b->chunk;
+		} else {
+			a->chunk = b->chunk;
+			a->cur = b->cur;
+			a->end = b->end;
+		}
+	}
+	for (i = 0; i < LA_CLS; i++)
+		if (b->free[i]) {
+			for (p = &b->free[i]; *p; p = (char**)*p);
+			*p = a->free[i];
+			a->free[i] = b->free[i];
+		}
+	if (b->big) {
+		struct lbig *g = b->big;
+		for (; g->next; g = g->next);
+		if ((g->next = a->big))
+			a->big->prev = g;
+		a->big = b->big;
+	}
+	a->nbigcls += b->nbigcls;
+	memset(b, 0, sizeof(*b));
+	if (ok && src->map_n) {
+		lb->map = erealloc(lb->map, (lb->map_n + src->map_n) * sizeof(lb->map[0]));
+		for (i = 0; i < src->map_n; i++) {
+			lb->map[lb->map_n] = src->map[i];
+			lb->map[lb->map_n++].base += shift;
+		}
+		lb->map_end += src->map_end;
+		free(src->map);
+		src->map = NULL;
+		src->map_n = 0;
+	}
+	if (n)
+		lbuf_sbedit(lb, sb, NULL, n, pos, pos, 0, 0);
+	else
+		free(sb->s);
+}
+
+/* map a regular file, returning the index of the mapping */
+static int lbuf_mmap(struct lbuf *lb, int fd, struct stat *st)
+{
+	size_t sz = st->st_size;
+	char *s;
+	if (!sz || sz > ((size_t)-1 >> 1) - lb->map_end)
+		return -1;
+	if ((s = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return -1;
+	lb->map = erealloc(lb->map, (lb->map_n + 1) * sizeof(lb->map[0]));
+	struct lmap *m = &lb->map[lb->map_n];
+	m->s = s;
+	m->sz = sz;
+	m->base = lb->map_end;
+	m->dev = st->st_dev;
+	m->ino = st->st_ino;
+	lb->map_end += sz + 1;
+	return lb->map_n++;
+}
+
+/* consume about max bytes of ld (all if negative), adding lines to sb;
+returns 1 if more remains, 0 at the end and -1 on read errors */
+static int lbuf_ldstep(struct lload *ld, sbuf *sb, long max)
+{
+	char buf[1 << 16], *s, *p, *e, *lim, *nl, *z = NULL, *ln;
+	long nr = 0;
+	if (ld->fd < 0) {
+		struct lmap *m = &ld->lb->map[ld->map];
+		s = m->s;
+		e = s + m->sz;
+		lim = max < 0 || (size_t)max >= m->sz - ld->off ? e : s + ld->off + max;
+		for (p = s + ld->off; p < lim; p = nl + 1) {
+			nl = memchr(p, '\n', e - p);
+			if ((z = memchr(p, '\0', (nl ? nl : e) - p)) || !nl)
+				nl = z ? z : e;		/* text past a nul is dropped */
+			if (z == p)
+				break;
+			/* lines near the end lack the fat nul pad of a record */
+			ln = z || e - nl < 5 ? lbuf_line(ld->lb, p, nl - p)
+				: (char*)(((m->base + (p - s)) << 1) | 1);
+			sbuf_mem(sb, &ln, sizeof(ln))
+			if (z)
+				break;
+		}
+		ld->off = MIN((size_t)(p - s), m->sz);
+		return !z && ld->off < m->sz;
+	}
+	while (max < 0 || max > 0) {
+		if ((nr = read(ld->fd, buf, sizeof(buf))) <= 0)
+			break;
+		ld->off += nr;
+		max = max < 0 ? max : MAX(0, max - nr);
+		for (p = buf, e = buf + nr; p < e && !ld->nul; p = nl + 1) {
+			nl = memchr(p, '\n', e - p);
+			if ((z = memchr(p, '\0', (nl ? nl : e) - p))) {
+				nl = z;		/* text past a nul is dropped */
+				ld->nul = 1;
+			} else if (!nl) {
+				sbuf_mem(ld->part, p, e - p)
+				break;
+			}
+			if (ld->part->s_n) {
+				sbuf_mem(ld->part, p, nl - p)
+				ln = lbuf_line(ld->lb, ld->part->s, ld->part->s_n);
+				sbuf_cut(ld->part, 0)
+			} else if (z == p)
+				break;
+			else
+				ln = lbuf_line(ld->lb, p, nl - p);
+			sbuf_mem(sb, &ln, sizeof(ln))
+		}
+		if (ld->nul && max >= 0)
+			return 0;
+	}
+	if (!max)
+		return 1;
+	if (ld->part->s_n) {
+		ln = lbuf_line(ld->lb, ld->part->s, ld->part->s_n);
+		sbuf_mem(sb, &ln, sizeof(ln))
+	}
+	return nr ? -1 : 0;
+}
+
+/* continue the background load by max bytes, finishing it if max is negative;
+returns the percentage loaded, -1 if nothing is left to load, or -2 if
+reading failed, which leaves the buffer modified */
+int lbuf_load(long max)
+{
+	struct lload *ld = &lbuf_bg;
+	int r = 1;
+	if (!ld->lb)
+		return -1;
+	if (max) {
+		sbuf_smake(sb, 1024 * sizeof(char*))
+		r = lbuf_ldstep(ld, sb, max);
+		/* appends to a fresh buffer need no undo history */
+		lbuf_splice(ld->lb, ld->lb->ln_n, 0, (char**)sb->s, sb->s_n / sizeof(char*));
+		free(sb->s);
+	}
+	if (r < 0) {
+		ld->lb->rderr = 1;
+		ld->lb->modified = 1;
+		ld->lb->saved = -1;
+	}
+	if (r <= 0) {
+		lbuf_ldend(ld, 1);
+		return r - 1;
+	}
+	return ld->off * 100 / MAX(1, ld->sz);
+}
+
+/*
+ * Blocks not used for xzc idle periods are compressed while waiting
+ * for input, with an LZ77 variant: each sequence is a token byte with
+ * the number of literals and the match length - 4 in its nibbles, the
+ * literals, then a 2 byte match offset.  A nibble of 15 is continued
+ * by bytes added to it up to the first one below 255.  The last
+ * sequence has literals only.  Accessing a line decompresses its
+ * block, which is compressed again once it goes cold.
+ */
+static void lz_len(sbuf *sb, int n)
+{
+	for (; n >= 255; n -= 255)
+		sbuf_chr(sb, (char)255)
+	sbuf_chr(sb, n)
+}
+
+static void lz_seq(sbuf *sb, char *lit, int n, int m, int off)
+{
+	sbuf_chr(sb, MIN(n, 15) << 4 | (m ? MIN(m - 4, 15) : 0))
+	if (n >= 15)
+		lz_len(sb, n - 15);
+	sbuf_mem(sb, lit, n)
+	if (!m)
+		return;
+	sbuf_chr(sb, off & 255)
+	sbuf_chr(sb, off >> 8)
+	if (m - 4 >= 15)
+		lz_len(sb, m - 19);
+}
+
+static void lz_pack(sbuf *sb, char *s, int n)
+{
+	static int ht[1 << 12];
+	int i = 0, lit = 0, p, m;
+	unsigned v;
+	memset(ht, 0xff, sizeof(ht));
+	while (i + 4 <= n) {
+		memcpy(&v, s + i, 4);
+		v = (v * 2654435761u) >> 20;
+		p = ht[v];
+		ht[v] = i;
+		if (p < 0 || i - p > 65535 || memcmp(s + p, s + i, 4)) {
+			i++;
+			continue;
+		}
+		for (m = 4; i + m < n && s[p + m] == s[i + m]; m++);
+		lz_seq(sb, s + lit, i - lit, m, i - p);
+		i += m;
+		lit = i;
+	}
+	lz_seq(sb, s + lit, n - lit, 0, 0);
+}
+
+static void lz_unpack(unsigned char *z, int n, char *d)
+{
+	unsigned char *e = z + n;
+	int t, l, off;
+	while (z < e) {
+		t = *z++;
+		if ((l = t >> 4) == 15)
+			do l += *z; while (*z++ == 255);
+		memcpy(d, z, l);
+		d += l;
+		z += l;
+		if (z >= e)
+			break;
+		off = z[0] | z[1] << 8;
+		z += 2;
+		if ((l = (t & 15) + 4) == 19)
+			do l += *z; while (*z++ == 255);
+		for (; l; l--, d++)
+			*d = d[-off];
+	}
+}
+
+/* compress the lines of block b, if it has only private records and
+no checkpoint shares it; shared records would outlive the block anyway */
+static int lbuf_zsave(struct lbuf *lb, int b)
+{
+	struct lblk *k = lb->blk[b];
+	int i, len;
+	char *s;
+	if (k->shr)
+		return 0;
+	for (i = 0; i < k->n; i++)
+		if (lbuf_tagged(k->ln[i]) || lbuf_s(k->ln[i])->grec
+				|| lbuf_s(k->ln[i])->ref)
+			return 0;
+	if (k->bytes < 0)
+		k->bytes = lbuf_bytes(lb, k->ln, k->n);
+	sbuf_smake(sb, k->bytes + 1)
+	for (i = 0; i < k->n; i++) {
+		s = lbuf_text(lb, k->ln[i], &len);
+		sbuf_mem(sb, s, len + 1)
+	}
+	sbuf_smake(z, k->bytes / 2 + 16)
+	lz_pack(z, sb->s, sb->s_n);
+	free(sb->s);
+	if (z->s_n > k->bytes / 2) {	/* not worth it */
+		free(z->s);
+		return 0;
+	}
+	for (i = 0; i < k->n; i++)
+		lbuf_lfree(lb, k->ln[i]);
+	k->z = erealloc(z->s, z->s_n);
+	k->zn = z->s_n;
+	lb->blk[b] = erealloc(k, sizeof(*k) - sizeof(k->ln));
+	return 1;
+}
+
+static void lbuf_zload(struct lbuf *lb, int b)
 {
-	int len = dstrlen(s, '\n');
-	return s[len] == '\n' ? len + 1 : len;
+	struct lblk *k = lb->blk[b];
+	char *s = emalloc(k->bytes), *p = s, *nl;
+	lz_unpack((unsigned char*)k->z, k->zn, s);
+	if (k->shr) {	/* checkpoints keep the compressed block */
+		k->shr--;
+		k = memcpy(emalloc(sizeof(*k)), k, sizeof(*k) - sizeof(k->ln));
+		k->shr = 0;
+	} else {
+		free(k->z);
+		k = erealloc(k, sizeof(*k));
+	}
+	k->z = NULL;
+	for (int i = 0; i < k->n; i++, p = nl + 1) {
+		nl = memchr(p, '\n', s + k->bytes - p);
+		k->ln[i] = lbuf_line(lb, p, nl - p);
+	}
+	free(s);
+	lb->blk[b] = k;
 }
 
-/* low-level line replacement */
-static int lbuf_replace(struct lbuf *lb, sbuf *sb, char *s, struct lopt *lo, int n_del, int n_ins)
+/* compress a cold block of lb, whose cursor is at row; lb of NULL starts
+a new idle period; returns nonzero while there may be more to do */
+int lbuf_cold(struct lbuf *lb, int row)
 {
-	int i, pos = lo->pos;
-	if (s) {
-		for (; *s; n_ins++) {
-			int l = linelength(s);
-			int l_nonl = l - (s[l - !!l] == '\n');
-			struct linfo *n = emalloc(l_nonl + 5 + sizeof(struct linfo));
-			n->len = l_nonl;
-			n->grec = 0;
-			char *ln = (char*)(n + 1);
-			memcpy(ln, s, l_nonl);
-			memset(&ln[l_nonl + 1], 0, 4);	/* fault tolerance pad */
-			ln[l_nonl] = '\n';
-			sbuf_mem(sb, &ln, sizeof(s))
-			s += l;
-		}
+	int i, off;
+	if (!lb) {
+		lbuf_tick++;
+		return 0;
 	}
-	if (lb->ln_n + n_ins - n_del >= lb->ln_sz) {
-		int nsz = lb->ln_n + n_ins - n_del + 512;
-		char **nln = emalloc(nsz * sizeof(lb->ln[0]));
-		memcpy(nln, lb->ln, lb->ln_n * sizeof(lb->ln[0]));
-		free(lb->ln);
-		lb->ln = nln;
-		lb->ln_sz = nsz;
+	if (xzc <= 0 || lbuf_bg.lb == lb)
+		return 0;
+	if (lb->ztick != lbuf_tick) {	/* keep blocks around marks warm */
+		lb->ztick = lbuf_tick;
+		lb->zpos = 0;
+		for (i = -1; i < lb->mark_n; i++) {
+			int r = i < 0 ? row : lb->mark[i * 3 + 1];
+			if (r >= 0 && r < lb->ln_n)
+				lb->blk[lbuf_blk(lb, r, &off)]->used = lbuf_tick;
+		}
 	}
-	if (n_ins != n_del) {
-		memmove(lb->ln + pos + n_ins, lb->ln + pos + n_del,
-			(lb->ln_n - pos - n_del) * sizeof(lb->ln[0]));
+	for (; lb->zpos < lb->blk_n; lb->zpos++) {
+		struct lblk *k = lb->blk[lb->zpos];
+		if (!k->z && k->n && lbuf_tick - k->used > xzc) {
+			k->used = lbuf_tick;
+			lb->ztrim |= lbuf_zsave(lb, lb->zpos++);
+			return 1;
+		}
 	}
-	lb->ln_n += n_ins - n_del;
-	for (i = 0; i < n_ins; i++)
-		lb->ln[pos + i] = *((char**)sb->s + i);
-	for (i = 0; i < lb->mark_n; i++) {	/* updating marks */
-		int *m = lb->mark + i * 3, *lm;
-		if (m[1] >= pos + n_ins && m[1] < pos + n_del) {
-			mark_set(&lo->mark, &lo->mark_n, m[0], m[1], m[2]);
-			m[1] = n_ins ? pos + n_ins - 1 : -1;
-		} else if (m[1] >= pos + n_del) {
-			m[1] += n_ins - n_del;
-		} else if ((lm = mark_find(lo->mark, lo->mark_n, m[0])))
-			lbuf_copymark((m + 1), lm)
+	if (lb->ztrim) {	/* give back the memory of the records */
+		la_trim(&lb->la);
+		la_trim(&lbuf_il.la);
+		lb->ztrim = 0;
 	}
-	return n_ins;
+	return 0;
 }
 
-void lbuf_smark(struct lbuf *lb, struct lopt *lo, int beg, int o1)
+/* append the text of fd from offset off to its end to lb in one edit,
+continuing the last line if the text before off did not end it;
+returns the offset reached or -1 */
+long lbuf_tail(struct lbuf *lb, int fd, long off)
 {
-	lbuf_copymark(lo->mark_sb, lb->mark_sb)
-	lb->mark_sb[0] = beg;
-	lb->mark_sb[1] = o1;
+	struct lload ld = {lb, fd};
+	char c = '\n', *s;
+	int beg = lb->ln_n, len, r;
+	if (lbuf_bg.lb == lb || lseek(fd, off, SEEK_SET) < 0
+			|| (off && pread(fd, &c, 1, off - 1) != 1))
+		return -1;
+	sbuf_make(ld.part, 128)
+	if (c != '\n' && beg) {
+		s = lbuf_raw(lb, --beg, &len);
+		sbuf_mem(ld.part, s, len)
+	}
+	sbuf_smake(sb, 1024 * sizeof(char*))
+	r = lbuf_ldstep(&ld, sb, -1);
+	lbuf_sbedit(lb, sb, NULL, sb->s_n / sizeof(char*), beg, lb->ln_n, 0, 0);
+	lbuf_ldend(&ld, 0);
+	return r < 0 ? -1 : off + (long)ld.off;
 }
 
-void lbuf_emark(struct lbuf *lb, struct lopt *lo, int end, int o2)
+/* if the file st (or any file) is mapped, copy out all mapped lines */
+void lbuf_unmap(struct lbuf *lb, struct stat *st)
 {
-	lbuf_copymark(lo->mark_se, lb->mark_se)
-	lb->mark_se[0] = end;
-	lb->mark_se[1] = o2;
-	if (xseq < 0)
-		lopt_done(lo);
+	int i, j, c;
+	if (lbuf_bg.lb == lb && lbuf_bg.fd < 0)
+		lbuf_load(-1);
+	for (i = 0; i < lb->map_n; i++)
+		if (!st || (lb->map[i].dev == st->st_dev && lb->map[i].ino == st->st_ino))
+			break;
+	if (i == lb->map_n)
+		return;
+	for (c = -1; c < lb->chk_n; c++) {
+		struct lblk **blk = c < 0 ? lb->blk : lb->chk[c].blk;
+		int n = c < 0 ? lb->blk_n : lb->chk[c].blk_n;
+		/* blocks shared with checkpoints are changed for all */
+		for (j = 0; j < n; j++)
+			for (i = 0; !blk[j]->z && i < blk[j]->n; i++)
+				if (lbuf_tagged(blk[j]->ln[i]))
+					blk[j]->ln[i] = lbuf_untag(lb, blk[j]->ln[i]);
+	}
+	for (j = 0; j < lb->hist_n; j++) {
+		struct lopt *lo = &lb->hist[j];
+		/* the side present on lbuf is stale, see lbuf_undo() */
+		for (i = 0; !(lo->ref & 2) && i < lo->n_ins; i++)
+			if (lbuf_tagged(lo->ins[i]))
+				lo->ins[i] = lbuf_untag(lb, lo->ins[i]);
+		for (i = 0; !(lo->ref & 5) && i < lo->n_del; i++)
+			if (lbuf_tagged(lo->del[i]))
+				lo->del[i] = lbuf_untag(lb, lo->del[i]);
+	}
+	for (i = 0; i < lb->map_n; i++)
+		munmap(lb->map[i].s, lb->map[i].sz);
+	free(lb->map);
+	lb->map = NULL;
+	lb->map_n = 0;
 }
 
-/* append undo/redo history */
-struct lopt *lbuf_opt(struct lbuf *lb, int beg, int o1, int n_del)
+static int lbuf_reload(struct lbuf *lb, int fd);
+
+/* read fd into lines beg through end; if bg, a large file read into an
+empty buffer may be finished later by lbuf_load(); if reload, fd replaces
+the whole buffer, editing only the lines that differ */
+int lbuf_rd(struct lbuf *lb, int fd, int beg, int end, int bg, int reload)
 {
-	struct lopt *lo;
-	static struct lopt slo;
-	if (xseq < 0)
-		lo = &slo;
-	else {
-		for (int i = lb->hist_u; i < lb->hist_n; i++)
-			lopt_done(&lb->hist[i]);
-		lb->hist_n = lb->hist_u;
-		if (lb->hist_n == lb->hist_sz) {
-			int sz = lb->hist_sz + (lb->hist_sz ? lb->hist_sz : 128);
-			struct lopt *hist = emalloc(sz * sizeof(hist[0]));
-			memcpy(hist, lb->hist, lb->hist_n * sizeof(hist[0]));
-			free(lb->hist);
-			lb->hist = hist;
-			lb->hist_sz = sz;
+	struct stat st;
+	struct lload ld = {lb, fd};
+	int r;
+	if (reload && lb->ln_n)
+		return lbuf_reload(lb, fd);
+	bg = bg && !lb->ln_n && !lb->hist_n;
+	if (fstat(fd, &st) >= 0 && S_ISREG(st.st_mode)) {
+		ld.sz = st.st_size;
+		if (xmm >= 0 && st.st_size >= (off_t)xmm << 20
+				&& (ld.map = lbuf_mmap(lb, fd, &st)) >= 0)
+			ld.fd = -1;
+	} else
+		bg = 0;
+	bg = bg && ld.sz > LOAD_STEP;
+	if (bg) {
+		lbuf_load(-1);
+		if (ld.fd >= 0 && (ld.fd = dup(fd)) < 0) {
+			ld.fd = fd;
+			bg = 0;
 		}
-		lo = &lb->hist[lb->hist_n++];
-		lb->hist_u = lb->hist_n;
 	}
-	lo->ins = NULL;
-	lo->del = n_del ? emalloc(n_del * sizeof(lo->del[0])) : NULL;
-	for (int i = 0; i < n_del; i++)
-		lo->del[i] = lb->ln[beg + i];
-	lo->mark = NULL;
-	lo->mark_n = 0;
-	lo->mark_sb[0] = -1;
-	lo->mark_se[0] = -1;
-	lo->pos = beg;
-	lo->pos_off = o1;
-	lo->n_ins = 0;
-	lo->n_del = n_del;
-	lo->seq = lb->useq;
-	lo->ref = 2;
-	return lo;
+	if (ld.fd >= 0)
+		sbuf_make(ld.part, 128)
+	sbuf_smake(sb, 1024 * sizeof(char*))
+	r = lbuf_ldstep(&ld, sb, bg ? LOAD_STEP : -1);
+	lbuf_sbedit(lb, sb, NULL, sb->s_n / sizeof(char*), beg, end, 0, 0);
+	if (r > 0) {
+		lbuf_saved(lb, 1);
+		lbuf_bg = ld;
+		return 0;
+	}
+	lbuf_ldend(&ld, bg);
+	return r < 0;
 }
 
-/* replace lines beg through end with buf */
-void lbuf_edit(struct lbuf *lb, char *buf, int beg, int end, int o1, int o2)
+/* the edit distance beyond which a reload replaces all differing lines */
+#define RD_DMAX		1024
+
+static int lbuf_rdeq(struct lbuf *a, int i, struct lbuf *b, int j)
 {
-	if (beg > lb->ln_n)
-		beg = lb->ln_n;
-	if (end > lb->ln_n)
-		end = lb->ln_n;
-	if (beg == end && !buf)
+	int l1, l2;
+	char *s1 = lbuf_raw(a, i, &l1), *s2 = lbuf_raw(b, j, &l2);
+	return l1 == l2 && !memcmp(s1, s2, l1);
+}
+
+/* replace lines beg through end of lb with lines tb through te of t */
+static void lbuf_rdhunk(struct lbuf *lb, int beg, int end, struct lbuf *t, int tb, int te)
+{
+	int i, len;
+	char *s, *ln;
+	if (beg == end && tb == te)
 		return;
-	struct lopt *lo = lbuf_opt(lb, beg, o1, end - beg);
-	sbuf_smake(sb, sizeof(lo->ins[0])+1)
-	lo->n_ins = lbuf_replace(lb, sb, buf, lo, lo->n_del, 0);
-	if (lb->hist_u < 2 || lb->hist[lb->hist_u - 2].seq != lb->useq)
-		lbuf_smark(lb, lo, beg, o1);
-	lbuf_emark(lb, lo, beg + (lo->n_ins ? lo->n_ins - 1 : 0), o2);
-	lb->modified = 1;
-	if (lb->saved > lb->hist_u)
-		lb->saved = -1;
-	if (xseq < 0 || !lo->n_ins)
-		free(sb->s);
-	else
-		lo->ins = (char**)sb->s;
+	sbuf_smake(sb, (te - tb) * sizeof(char*) + 1)
+	for (i = tb; i < te; i++) {
+		s = lbuf_raw(t, i, &len);
+		ln = lbuf_line(lb, s, len);
+		sbuf_mem(sb, &ln, sizeof(ln))
+	}
+	lbuf_sbedit(lb, sb, NULL, te - tb, beg, end, 0, 0);
 }
 
-int lbuf_rd(struct lbuf *lb, int fd, int beg, int end)
+/* replace the whole of lb with fd, editing only the lines that differ
+so that undo, marks and unchanged lines survive; after trimming the
+common ends, Myers' greedy diff finds the shortest edit script */
+static int lbuf_reload(struct lbuf *lb, int fd)
 {
-	struct stat st;
-	long nr;	/* 1048575 caps at 2147481600 on 32 bit */
-	int sz = 1048575, step = 1, n = 0;
-	if (fstat(fd, &st) >= 0 && S_ISREG(st.st_mode))
-		sz = st.st_size >= INT_MAX ? INT_MAX : st.st_size + step;
-	char *s = emalloc(sz--);
-	while ((nr = read(fd, s + n, sz - n)) > 0) {
-		n += nr;
-		if (n >= sz + step) {
-			if (n > INT_MAX / 2) {
-				n -= nr;
-				break;
-			}
-			sz = n * 2;
-			s = erealloc(s, sz--);
-			step = 1;
-		} else if (n == sz) {
-			sz++;
-			step = 0;
+	struct lbuf *t = lbuf_make();
+	int n1 = lb->ln_n, n2, p, e, N, M, d, k, x, y, pk, px, py, *v, *tr;
+	int x0 = -1, x1 = 0, y0 = 0, y1 = 0, max, r, len;
+	unsigned *ha;
+	char *s;
+	preserve(int, xseq, xseq = -1;)
+	preserve(int, xmm, xmm = xmm >= 0 ? 0 : xmm;)	/* t only lends its lines */
+	r = lbuf_rd(t, fd, 0, 0, 0, 0);
+	restore(xmm)
+	restore(xseq)
+	if (r) {
+		lbuf_free(t);
+		return r;
+	}
+	n2 = t->ln_n;
+	for (p = 0; p < n1 && p < n2 && lbuf_rdeq(lb, p, t, p); p++);
+	for (e = 0; e < n1 - p && e < n2 - p && lbuf_rdeq(lb, n1 - e - 1, t, n2 - e - 1); e++);
+	N = n1 - p - e;
+	M = n2 - p - e;
+	max = MIN(N + M, RD_DMAX);
+	ha = emalloc((N + M + 1) * sizeof(ha[0]));
+	for (k = 0; k < N + M; k++) {
+		s = k < N ? lbuf_raw(lb, p + k, &len) : lbuf_raw(t, p + k - N, &len);
+		ha[k] = lbuf_hash(s, len);
+	}
+	v = emalloc((2 * max + 3) * sizeof(v[0]));
+	memset(v, 0, (2 * max + 3) * sizeof(v[0]));
+	v += max + 1;
+	tr = emalloc((max + 1) * (max + 1) * sizeof(tr[0]));
+	for (d = 0; d <= max; d++) {
+		memcpy(tr + d * d, v - d, (2 * d + 1) * sizeof(v[0]));
+		for (k = -d; k <= d; k += 2) {
+			x = k == -d || (k != d && v[k - 1] < v[k + 1]) ? v[k + 1] : v[k - 1] + 1;
+			for (y = x - k; x < N && y < M && ha[x] == ha[N + y]
+					&& lbuf_rdeq(lb, p + x, t, p + y); x++, y++);
+			v[k] = x;
+			if (x >= N && y >= M)
+				goto found;
 		}
 	}
-	s[n] = '\0';
-	lbuf_edit(lb, s, beg, end, 0, 0);
-	free(s);
-	return nr != 0;
+	lbuf_rdhunk(lb, p, p + N, t, p, p + M);
+	goto done;
+found:
+	/* walk the trace back, applying hunks bottom up */
+	for (x = N, y = M; d > 0; d--) {
+		int *w = tr + d * d + d;
+		k = x - y;
+		pk = k == -d || (k != d && w[k - 1] < w[k + 1]) ? k + 1 : k - 1;
+		px = w[pk];
+		py = px - pk;
+		r = pk == k + 1 ? px : px + 1;
+		if (x > r && x0 >= 0) {
+			lbuf_rdhunk(lb, p + x0, p + x1, t, p + y0, p + y1);
+			x0 = -1;
+		}
+		if (x0 < 0) {
+			x0 = x1 = r;
+			y0 = y1 = r - k;
+		}
+		if (pk == k + 1)
+			y0 = py;
+		else
+			x0 = px;
+		x = px;
+		y = py;
+	}
+	if (x0 >= 0)
+		lbuf_rdhunk(lb, p + x0, p + x1, t, p + y0, p + y1);
+done:
+	free(v - max - 1);
+	free(tr);
+	free(ha);
+	lbuf_free(t);
+	return 0;
 }
 
 int lbuf_wr(struct lbuf *lb, int fd, int beg, int end)
 {
-	for (int i = beg; i < end; i++) {
-		char *ln = lb->ln[i];
-		long nw = 0;
-		long nl = lbuf_s(ln)->len + 1;
-		while (nw < nl) {
-			long nc = write(fd, ln + nw, nl - nw);
-			if (nc < 0)
-				return nc;
-			nw += nc;
+	struct iovec iov[1024];
+	long max = sysconf(_SC_IOV_MAX), nw;
+	int i = beg, n, k, len;
+	char *s;
+	max = max > 0 ? MIN(max, (long)LEN(iov)) : 16;
+	while (i < end) {
+		for (n = 0; i < end; i++) {
+			s = lbuf_raw(lb, i, &len);
+			if (n && (char*)iov[n - 1].iov_base + iov[n - 1].iov_len == s) {
+				iov[n - 1].iov_len += len + 1;	/* adjacent mapped lines */
+				continue;
+			}
+			if (n == max)
+				break;
+			iov[n].iov_base = s;
+			iov[n++].iov_len = len + 1;
+		}
+		for (k = 0; k < n;) {
+			if ((nw = writev(fd, iov + k, n - k)) < 0)
+				return nw;
+			for (; k < n && (size_t)nw >= iov[k].iov_len; k++)
+				nw -= iov[k].iov_len;
+			if (k < n) {
+				iov[k].iov_base = (char*)iov[k].iov_base + nw;
+				iov[k].iov_len -= nw;
+			}
 		}
 	}
 	return 0;
@@ -274,20 +1993,23 @@ void lbuf_region(struct lbuf *lb, sbuf *sb, int r1, int o1, int r2, int o2)
 	if (s1) {
 		char *send = s1 + lbuf_s(s1)->len+1;
 		if (r1 == r2) {
-			s1 = uc_chr(s1, o1);
+			s1 = lbuf_chr(s1, o1);
 			s2 = o2 >= o1 ? uc_chr(s1, o2 - o1) : send;
 			if (s2 > s1)
 				sbuf_mem(sb, s1, s2 - s1)
 			goto ret;
 		}
-		s2 = o1 >= 0 ? uc_chr(s1, o1) : send;
+		s2 = o1 >= 0 ? lbuf_chr(s1, o1) : send;
 		if (send > s2)
 			sbuf_mem(sb, s2, send - s2)
 	}
-	for (int i = r1 + 1; i < r2; i++)
-		sbuf_mem(sb, lb->ln[i], lbuf_i(lb, i)->len + 1)
+	for (int i = r1 + 1; i < r2; i++) {
+		int len;
+		char *ln = lbuf_raw(lb, i, &len);
+		sbuf_mem(sb, ln, len + 1)
+	}
 	if ((s2 = lbuf_get(lb, r2))) {
-		s1 = o2 >= 0 ? uc_chr(s2, o2) : s2 + lbuf_s(s2)->len+1;
+		s1 = o2 >= 0 ? lbuf_chr(s2, o2) : s2 + lbuf_s(s2)->len+1;
 		if (s1 > s2)
 			sbuf_mem(sb, s2, s1 - s2)
 	}
@@ -298,42 +2020,29 @@ void lbuf_region(struct lbuf *lb, sbuf *sb, int r1, int o1, int r2, int o2)
 /* convert (row, off) position to byte offset within region (r1,o1)-(r2,o2) */
 int lbuf_pos2off(struct lbuf *lb, int r1, int o1, int r2, int o2, int row, int off)
 {
-	int boff = 0, sub;
-	char *ln = lbuf_get(lb, r1);
-	if (!ln || row < r1 || row > r2)
+	char *s1 = lbuf_get(lb, r1), *ln = lbuf_get(lb, row);
+	if (!s1 || !ln || row < r1 || row > r2)
 		return -1;
-	for (int i = r1; ln && i <= row;) {
-		if (i == row) {
-			if ((i == r1 && off < o1) || (o2 >= 0 && i == r2 && off > o2))
-				return -1;
-			sub = uc_chr(lb->ln[r1], o1) - lb->ln[r1];
-			boff -= boff ? sub : 0;
-			if (i != r1)
-				sub = 0;
-			return boff + (uc_chr(ln, off) - (ln + sub));
-		}
-		boff += lbuf_i(lb, i)->len + 1;
-		ln = lbuf_get(lb, ++i);
-	}
-	return -1;
+	if ((row == r1 && off < o1) || (o2 >= 0 && row == r2 && off > o2))
+		return -1;
+	long boff = lbuf_boff(lb, row) - lbuf_boff(lb, r1) - (lbuf_chr(s1, o1) - s1);
+	return boff + (lbuf_chr(ln, off) - ln);
 }
 
 /* convert byte offset within region (r1,o1)-(r2,o2) to (row, off) position */
 int lbuf_off2pos(struct lbuf *lb, int r1, int o1, int r2, int o2, int boff, int *row, int *off)
 {
 	char *ln = lbuf_get(lb, r1);
+	long o;
 	if (!ln)
 		return 1;
-	int acc = -(uc_chr(ln, o1) - ln);
-	for (int i = r1; ln && i <= r2; ln = lbuf_get(lb, ++i)) {
-		acc += lbuf_i(lb, i)->len + 1;
-		if (acc > boff) {
-			*row = i;
-			*off = uc_off(ln, boff - (acc - (lbuf_i(lb, i)->len + 1)));
-			return o2 >= 0 && i == r2 && *off > o2;
-		}
-	}
-	return 1;
+	int i = lbuf_brow(lb, lbuf_boff(lb, r1) + (lbuf_chr(ln, o1) - ln) + boff, &o);
+	if (i < 0 || i > r2)
+		return 1;
+	ln = lbuf_get(lb, i);
+	*row = i;
+	*off = lbuf_off(ln, o);
+	return o2 >= 0 && i == r2 && *off > o2;
 }
 
 char *lbuf_joinsb(struct lbuf *lb, int r1, int r2, sbuf *i, int *o1, int *o2)
@@ -391,47 +2100,346 @@ int lbuf_join(struct lbuf *lb, int beg, int end, int o1, int *o2, int flg)
 
 char *lbuf_get(struct lbuf *lb, int pos)
 {
-	return pos >= 0 && pos < lb->ln_n ? lb->ln[pos] : NULL;
+	if (pos < 0 || pos >= lb->ln_n)
+		return NULL;
+	char **ln = lbuf_ln(lb, pos);
+	if (lbuf_tagged(*ln))
+		*ln = lbuf_untag(lb, *ln);
+	return *ln;
 }
 
-int lbuf_undo(struct lbuf *lb, int *row, int *off)
+/* line pos in a record not shared with other lines, for setting grec */
+char *lbuf_own(struct lbuf *lb, int pos)
 {
-	if (!lb->hist_u)
-		return 1;
-	struct lopt *lo = &lb->hist[lb->hist_u - 1];
-	const int useq = lo->seq;
-	sbuf sb;
-	if (lb->hist_u == lb->hist_n) {
-		lbuf_copymark(lb->tmp_mark, lb->mark_sb)
-		lbuf_copymark((lb->tmp_mark + 2), lb->mark_se)
+	char *ln = lbuf_get(lb, pos), **p;
+	int off;
+	if (!ln)
+		return ln;
+	p = &lbuf_kw(lb, lbuf_blk(lb, pos, &off))->ln[off];
+	if (!lbuf_s(ln)->ref)
+		return ln;
+	char *r = lbuf_lalloc(&lb->la, lbuf_s(ln)->len);
+	memcpy(r, ln, lbuf_s(ln)->len);
+	lbuf_s(r)->nchr = lbuf_s(ln)->nchr;
+	lbuf_lfree(lb, ln);
+	return *p = r;
+}
+
+/* interned records of lines beg through end, each with a reference for
+the caller; the lines of lb become interned to share them */
+char **lbuf_lshare(struct lbuf *lb, int beg, int end)
+{
+	char **ln, **p, *r, *s;
+	int i, len;
+	if (beg < 0 || beg > end || end > lbuf_len(lb))
+		return NULL;
+	ln = emalloc((end - beg + 1) * sizeof(ln[0]));
+	for (i = beg; i < end; i++) {
+		p = lbuf_ln(lb, i);
+		if (!lbuf_tagged(*p) && lbuf_s(*p)->ref > 0) {
+			lbuf_s(*p)->ref++;
+			ln[i - beg] = *p;
+			continue;
+		}
+		s = lbuf_text(lb, *p, &len);
+		ln[i - beg] = r = lbuf_intern(s, len);
+		if (lbuf_tagged(*p) || !lbuf_s(*p)->grec) {	/* :g marks stay */
+			lbuf_lfree(lb, *p);
+			*p = r;
+			lbuf_s(r)->ref++;
+		}
+	}
+	return ln;
+}
+
+/* a copy of n shared records with references of its own */
+char **lbuf_lcopy(char **ln, int n)
+{
+	char **r = emalloc((n + 1) * sizeof(r[0]));
+	for (int i = 0; i < n; i++) {
+		r[i] = ln[i];
+		lbuf_s(r[i])->ref++;
+	}
+	return r;
+}
+
+/* drop the references of n shared records */
+void lbuf_ldrop(char **ln, int n)
+{
+	for (int i = 0; i < n; i++)
+		lbuf_lfree(NULL, ln[i]);
+}
+
+/* insert cnt times the n shared records of ln before line pos */
+void lbuf_lput(struct lbuf *lb, int pos, char **ln, int n, int cnt, int o1)
+{
+	sbuf_smake(sb, n * cnt * sizeof(char*) + 1)
+	for (int i = 0; i < n * cnt; i++) {
+		lbuf_s(ln[i % n])->ref++;
+		sbuf_mem(sb, &ln[i % n], sizeof(ln[0]))
+	}
+	lbuf_sbedit(lb, sb, NULL, n * cnt, pos, pos, o1, o1);
+}
+
+/* remove the lines equal to the n bytes at s, without history */
+void lbuf_dedup(struct lbuf *lb, char *s, int n)
+{
+	unsigned h = lbuf_hash(s, n), *c;
+	int i, len;
+	char *t;
+	if (!lb->hash)
+		lbuf_hashmake(lb, lb->ln_n);
+	preserve(int, xseq, xseq = -1;)
+	/* lines are often repeated soon, so search from the end */
+	for (i = lb->ln_n - 1; i >= 0 && (c = lbuf_hcnt(lb, h, 0)) && *c; i--) {
+		t = lbuf_text(lb, *lbuf_ln(lb, i), &len);
+		if (len == n && !memcmp(s, t, n))
+			lbuf_edit(lb, NULL, i, i + 1, 0, 0);
 	}
-	while (lb->hist_u && lb->hist[lb->hist_u - 1].seq == useq) {
+	restore(xseq)
+}
+
+/* undo the ops after hist[h], the ones of a seq at once if possible */
+static void lbuf_undoops(struct lbuf *lb, int h)
+{
+	struct lopt *lo;
+	sbuf sb;
+	if (lb->hist_u - h > 1 && !lbuf_bulk(lb, h, lb->hist_u - h, 1))
+		lb->hist_u = h;
+	while (lb->hist_u > h) {
 		lo = &lb->hist[--lb->hist_u];
+		lbuf_jlog(lb, lo, 'u', NULL);
 		lo->ref = 1;
+		/* the side on lbuf is not kept; later ops or a mapping copy
+		may have replaced its records */
+		lo->ins = lbuf_lns(lb, lo->pos, lo->n_ins);
+		lbuf_delta(lb, lo->del, lo->ins, MIN(lo->n_del, lo->n_ins), 0);
 		sb.s = (char*)lo->del;
 		lbuf_replace(lb, &sb, NULL, lo, lo->n_ins, lo->n_del);
+		lbuf_delta(lb, lo->ins, lo->del, MIN(lo->n_del, lo->n_ins), 1);
+		free(lo->del);
+		lo->del = NULL;
+		lopt_size(lb, lo);
 	}
-	*row = lo->pos;
-	*off = MAX(0, lo->pos_off);
-	lbuf_copymark(lb->mark_sb, lo->mark_sb)
-	lbuf_copymark(lb->mark_se, lo->mark_se)
-	lb->modified = lb->hist_u != lb->saved;
-	return 0;
 }
 
-int lbuf_redo(struct lbuf *lb, int *row, int *off)
+/* redo the ops before hist[h], the ones of a seq at once if possible */
+static void lbuf_redoops(struct lbuf *lb, int h)
 {
-	if (lb->hist_u == lb->hist_n)
-		return 1;
-	struct lopt *lo = &lb->hist[lb->hist_u];
-	const int useq = lo->seq;
+	struct lopt *lo;
 	sbuf sb;
-	while (lb->hist_u < lb->hist_n && lb->hist[lb->hist_u].seq == useq) {
+	if (h - lb->hist_u > 1 && !lbuf_bulk(lb, lb->hist_u, h - lb->hist_u, 0))
+		lb->hist_u = h;
+	while (lb->hist_u < h) {
 		lo = &lb->hist[lb->hist_u++];
+		lbuf_jlog(lb, lo, 'r', NULL);
 		lo->ref = 2;
+		lo->del = lbuf_lns(lb, lo->pos, lo->n_del);
+		lbuf_delta(lb, lo->ins, lo->del, MIN(lo->n_del, lo->n_ins), 0);
 		sb.s = (char*)lo->ins;
 		lbuf_replace(lb, &sb, NULL, lo, lo->n_del, lo->n_ins);
+		lbuf_delta(lb, lo->del, lo->ins, MIN(lo->n_del, lo->n_ins), 1);
+		free(lo->ins);
+		lo->ins = NULL;
+		lopt_size(lb, lo);
+	}
+}
+
+/* the first op of the seq of hist[h - 1] */
+static int lbuf_seqbeg(struct lbuf *lb, int h)
+{
+	int seq = lb->hist[h - 1].seq;
+	while (h && lb->hist[h - 1].seq == seq)
+		h--;
+	return h;
+}
+
+/* the op after the seq of hist[h] */
+static int lbuf_seqend(struct lbuf *lb, int h)
+{
+	int seq = lb->hist[h].seq;
+	while (h < lb->hist_n && lb->hist[h].seq == seq)
+		h++;
+	return h;
+}
+
+/* undo the ops after hist[h] that hold their deleted lines, reading
+them back from the journal first; returns nonzero if that fails, after
+undoing the seqs above the one that could not be read */
+static int lbuf_undoto(struct lbuf *lb, int h)
+{
+	int e, b, i;
+	for (e = lb->hist_u; e > h; e = b) {
+		b = MAX(h, lbuf_seqbeg(lb, e));
+		for (i = e; i > b && !lbuf_jload(lb, &lb->hist[i - 1]); i--);
+		if (i > b)
+			break;
+	}
+	if (lb->hist_u > e && lbuf_seqbeg(lb, lb->hist_u) > e
+			&& !lbuf_bulk(lb, e, lb->hist_u - e, 1))
+		lb->hist_u = e;
+	while (lb->hist_u > e)
+		lbuf_undoops(lb, MAX(e, lbuf_seqbeg(lb, lb->hist_u)));
+	return e > h;
+}
+
+/* redo the ops before hist[h], which hold their inserted lines */
+static void lbuf_redoto(struct lbuf *lb, int h)
+{
+	if (lbuf_seqend(lb, lb->hist_u) < h && !lbuf_bulk(lb, lb->hist_u, h - lb->hist_u, 0))
+		lb->hist_u = h;
+	while (lb->hist_u < h)
+		lbuf_redoops(lb, MIN(h, lbuf_seqend(lb, lb->hist_u)));
+}
+
+/* the first (or if last, the last) checkpoint from hist[b] to hist[e] */
+static int lbuf_chkin(struct lbuf *lb, int b, int e, int last)
+{
+	int i, c = -1;
+	for (i = 0; i < lb->chk_n && lb->chk[i].h <= e; i++)
+		if (lb->chk[i].h >= b && (c < 0 || last))
+			c = i;
+	return c;
+}
+
+/* lines changed by hist[b] through hist[e - 1] */
+static long lbuf_work(struct lbuf *lb, int b, int e)
+{
+	long w = 0;
+	for (; b < e; b++)
+		w += lb->hist[b].n_del + lb->hist[b].n_ins + 1;
+	return w;
+}
+
+/* make the lines of lbuf those of checkpoint c, taking marks through
+the ops in between as undoing or redoing them would */
+static void lbuf_chkjump(struct lbuf *lb, int c)
+{
+	struct lchk *ck = &lb->chk[c];
+	struct lopt *lo;
+	int i;
+	for (i = 0; i < lb->blk_n; i++)
+		lbuf_kput(lb, lb->blk[i]);
+	if (ck->blk_n > lb->blk_sz) {
+		lb->blk_sz = ck->blk_n;
+		lb->blk = erealloc(lb->blk, lb->blk_sz * sizeof(lb->blk[0]));
+		lb->fen = erealloc(lb->fen, (lb->blk_sz + 1) * sizeof(lb->fen[0]));
+		lb->bfen = erealloc(lb->bfen, (lb->blk_sz + 1) * sizeof(lb->bfen[0]));
+	}
+	for (i = 0; i < ck->blk_n; i++)
+		(lb->blk[i] = ck->blk[i])->shr++;
+	lb->blk_n = ck->blk_n;
+	lb->ln_n = ck->ln_n;
+	lbuf_fenmake(lb);
+	if (lb->hash)
+		lbuf_hashmake(lb, lb->ln_n);
+	while (lb->hist_u > ck->h) {
+		lo = &lb->hist[--lb->hist_u];
+		lbuf_jlog(lb, lo, 'u', NULL);
+		for (i = 0; i < lb->mark_n; i++)
+			lopt_mark(lo, lb->mark + i * 3, lo->n_ins, lo->n_del);
+	}
+	while (lb->hist_u < ck->h) {
+		lo = &lb->hist[lb->hist_u++];
+		lbuf_jlog(lb, lo, 'r', NULL);
+		for (i = 0; i < lb->mark_n; i++)
+			lopt_mark(lo, lb->mark + i * 3, lo->n_del, lo->n_ins);
+	}
+}
+
+/* bring lbuf to hist[t]; ops left holding the side on lbuf by a jump
+are replayed from the checkpoint bounding them, and others are jumped
+over when that saves work; returns nonzero if the journal could not
+be read, after getting as far as it could */
+static int lbuf_goto(struct lbuf *lb, int t)
+{
+	int p, e, c, i;
+	while ((p = lb->hist_u) != t) {
+		if (t < p && !(lb->hist[p - 1].ref & 2)) {
+			for (e = p; e > 0 && !(lb->hist[e - 1].ref & 2); e--);
+			if ((c = lbuf_chkin(lb, e, MAX(t, e), 1)) < 0)
+				return 1;
+			lbuf_chkjump(lb, c);
+			if (t > lb->hist_u)
+				lbuf_redoto(lb, t);
+		} else if (t < p) {
+			for (e = p; e > t && lb->hist[e - 1].ref & 2; e--);
+			c = lbuf_chkin(lb, e, p - 1, 0);
+			if (c >= 0 && lbuf_work(lb, lb->chk[c].h, p) >= LB_MAX + lb->blk_n) {
+				i = lb->chk[c].h;
+				if (p == lb->hist_n || !(lb->hist[p].ref & 2))
+					lbuf_chkadd(lb);
+				lbuf_chkjump(lb, lbuf_chkin(lb, i, i, 0));
+			} else if (lbuf_undoto(lb, e))
+				return 1;
+		} else if (lb->hist[p].ref & 2) {
+			for (e = p; e < lb->hist_n && lb->hist[e].ref & 2; e++);
+			if ((c = lbuf_chkin(lb, MIN(t, e), e, 0)) < 0)
+				return 1;
+			for (i = lb->chk[c].h; i > t; i--)
+				if (lbuf_jload(lb, &lb->hist[i - 1]))
+					return 1;
+			lbuf_chkjump(lb, c);
+			if (t < lb->hist_u && lbuf_undoto(lb, t))
+				return 1;
+		} else {
+			for (e = p; e < t && !(lb->hist[e].ref & 2); e++);
+			c = lbuf_chkin(lb, p + 1, e, 1);
+			if (c >= 0 && lbuf_work(lb, p, lb->chk[c].h) >= LB_MAX + lb->blk_n) {
+				i = lb->chk[c].h;
+				if (!p || lb->hist[p - 1].ref & 2)
+					lbuf_chkadd(lb);
+				lbuf_chkjump(lb, lbuf_chkin(lb, i, i, 0));
+			} else
+				lbuf_redoto(lb, e);
+		}
+	}
+	return 0;
+}
+
+/* undo cnt changes, returning the number that could not be undone;
+changes in line order, like the steps of a macro run down the buffer,
+are undone together */
+int lbuf_undo(struct lbuf *lb, int *row, int *off, int cnt)
+{
+	int u = lb->hist_u, h = u, n;
+	for (n = 0; n < cnt && h; n++)
+		h = lbuf_seqbeg(lb, h);
+	if (!n)
+		return cnt;
+	if (lb->hist_u == lb->hist_n) {
+		lbuf_copymark(lb->tmp_mark, lb->mark_sb)
+		lbuf_copymark((lb->tmp_mark + 2), lb->mark_se)
 	}
+	if (lbuf_goto(lb, h))
+		for (n = 0, h = u; h > lb->hist_u; n++)
+			h = lbuf_seqbeg(lb, h);
+	if (!n)
+		return cnt;
+	struct lopt *lo = &lb->hist[lb->hist_u];
+	lb->hist_j = MIN(lb->hist_j, lb->hist_u);
+	*row = lo->pos;
+	*off = MAX(0, lo->pos_off);
+	lbuf_copymark(lb->mark_sb, lo->mark_sb)
+	lbuf_copymark(lb->mark_se, lo->mark_se)
+	lb->modified = lb->hist_u != lb->saved;
+	return cnt - n;
+}
+
+/* redo cnt changes, returning the number that could not be redone */
+int lbuf_redo(struct lbuf *lb, int *row, int *off, int cnt)
+{
+	int u = lb->hist_u, h = u, n;
+	for (n = 0; n < cnt && h < lb->hist_n; n++)
+		h = lbuf_seqend(lb, h);
+	if (!n)
+		return cnt;
+	if (lbuf_goto(lb, h))
+		for (n = 0, h = u; h < lb->hist_u; n++)
+			h = lbuf_seqend(lb, h);
+	if (!n)
+		return cnt;
+	struct lopt *lo = &lb->hist[lb->hist_u - 1];
 	*row = lo->pos;
 	*off = MAX(0, lo->pos_off);
 	if (lb->hist_u < lb->hist_n) {
@@ -443,20 +2451,35 @@ int lbuf_redo(struct lbuf *lb, int *row, int *off)
 		lbuf_copymark(lb->mark_se, (lb->tmp_mark + 2))
 	}
 	lb->modified = lb->hist_u != lb->saved;
-	return 0;
+	return cnt - n;
 }
 
 /* mark buffer as saved and, if clear, clear the undo history */
 void lbuf_saved(struct lbuf *lb, int clear)
 {
-	if (clear) {
-		for (int i = 0; i < lb->hist_n; i++)
-			lopt_done(&lb->hist[i]);
-		lb->hist_n = 0;
-		lb->hist_u = 0;
-	}
+	if (clear)
+		lbuf_histfree(lb);
 	lb->modified = 0;
 	lb->saved = lb->hist_u;
+	lb->jsaved = lbuf_jsize(lb);
+	lb->rderr = 0;
+}
+
+/* note the state being written, or if done, mark it as saved */
+void lbuf_wsaved(struct lbuf *lb, int done)
+{
+	if (!done) {
+		lb->wsaved = lb->hist_u;
+		lb->jwsaved = lbuf_jsize(lb);
+		return;
+	}
+	if (lb->wsaved >= 0) {
+		lb->saved = lb->wsaved;
+		lb->jsaved = lb->jwsaved;
+		lb->modified = lb->hist_u != lb->saved;
+		lb->rderr = 0;
+	}
+	lb->wsaved = -1;
 }
 
 int lbuf_indents(struct lbuf *lb, int r)
@@ -500,14 +2523,14 @@ int lbuf_search(struct lbuf *lb, rset *re, int dir, int beg, int end, int pskip,
 	int off, g1, g2, _o, step, flg;
 	if (pskip >= 0 && s)
 		off = rstate->s == s ? rstate->chrs[MIN(o0 + pskip, rstate->n)] - s
-					: uc_chr(s, o0 + pskip) - s;
+					: lbuf_chr(s, o0 + pskip) - s;
 	else
 		off = 0;
 	for (; i >= beg && i < end; i += dir) {
+		s = lbuf_raw(lb, i, &_o);
 		_o = 0;
 		step = 0;
 		flg = REG_NEWLINE;
-		s = lb->ln[i];
 		while (rset_find(re, s + off, offs, flg) >= 0) {
 			flg |= REG_NOTBOL;
 			g1 = offs[xgrp], g2 = offs[xgrp + 1];
@@ -552,7 +2575,7 @@ int lbuf_eol(struct lbuf *lb, int row, int state)
 		return 0;
 	if (state == 2)
 		state = rstate->s == ln;
-	state = state ? ren_position(ln)->n - 1 : uc_slen(ln) - 1;
+	state = state ? ren_position(ln)->n - 1 : lbuf_slen(ln) - 1;
 	return state < 0 ? 0 : state;
 }
 
@@ -638,29 +2661,170 @@ int lbuf_wordend(struct lbuf *lb, int big, int dir, int *row, int *off)
 }
 
 /* move to the matching character */
+/* scan the characters of s[beg, end) in direction dir until dep, which
+c0 deepens and c1 lessens, reaches zero, returning its offset; as the
+renderer does, characters are decoded forward, even when scanning back */
+static int lbuf_pscan(char *s, int beg, int end, int dir, int c0, int c1, int *dep)
+{
+	int x, t = 0, u, r = -1;
+	if (dir > 0) {
+		for (x = beg; x < end; x += MAX(1, utf8_length[(unsigned char)s[x]]))
+			if (!(*dep += (s[x] == c0) - (s[x] == c1)))
+				return x;
+		return -1;
+	}
+	for (x = beg; x < end; x += MAX(1, utf8_length[(unsigned char)s[x]]))
+		t += (s[x] == c0) - (s[x] == c1);
+	/* scanning back, dep after x is *dep plus u, the balance from x on */
+	for (x = beg, u = t; x < end; x += MAX(1, utf8_length[(unsigned char)s[x]])) {
+		if (*dep + u == 0)
+			r = x;
+		u -= (s[x] == c0) - (s[x] == c1);
+	}
+	if (r < 0)
+		*dep += t;
+	return r;
+}
+
+static char lbuf_brk[] = "()[]{}";
+
+/* count the brackets of block b: the balance of openers over closers
+and its least value at any point in the block */
+static void lbuf_pairmake(struct lbuf *lb, int b)
+{
+	struct lblk *k = lbuf_k(lb, b);
+	int i, j, len, t;
+	char *s, *c;
+	memset(k->pair, 0, sizeof(k->pair));
+	for (i = 0; i < k->n; i++) {
+		s = lbuf_text(lb, k->ln[i], &len);
+		for (j = 0; j < len; j += MAX(1, utf8_length[(unsigned char)s[j]]))
+			if ((c = memchr(lbuf_brk, s[j], 6))) {
+				t = c - lbuf_brk;
+				k->pair[t / 2][0] += t & 1 ? -1 : 1;
+				k->pair[t / 2][1] = MIN(k->pair[t / 2][1], k->pair[t / 2][0]);
+			}
+	}
+	k->pok = 1;
+}
+
+/* a node of the bracket tree: the counts of its blocks, combined like
+lbuf_pairmake() does for lines; nodes whose least depth is positive
+are out of date */
+static int (*lbuf_pnode(struct lbuf *lb, int i))[2]
+{
+	int (*q)[2] = lb->ptree[i], (*a)[2], (*c)[2];
+	if (q[0][1] <= 0)
+		return q;
+	if (i >= lb->ptree_n) {
+		if (!lb->blk[i - lb->ptree_n]->pok)
+			lbuf_pairmake(lb, i - lb->ptree_n);
+		memcpy(q, lb->blk[i - lb->ptree_n]->pair, sizeof(lb->ptree[0]));
+		return q;
+	}
+	a = lbuf_pnode(lb, i * 2);
+	c = lbuf_pnode(lb, i * 2 + 1);
+	for (int t = 0; t < 3; t++) {
+		q[t][0] = a[t][0] + c[t][0];
+		q[t][1] = MIN(a[t][1], a[t][0] + c[t][1]);
+	}
+	return q;
+}
+
+/* the bracket tree has a leaf for each block, made out of date */
+static void lbuf_ptreemake(struct lbuf *lb)
+{
+	int n;
+	for (n = 1; n < lb->blk_n; n <<= 1);
+	lb->ptree = erealloc(lb->ptree, n * 2 * sizeof(lb->ptree[0]));
+	memset(lb->ptree, 0, n * 2 * sizeof(lb->ptree[0]));
+	for (int i = 1; i < n + lb->blk_n; i++)
+		lb->ptree[i][0][1] = 1;
+	lb->ptree_n = n;
+}
+
+/* the counts of block b changed */
+static void lbuf_pdirty(struct lbuf *lb, int b)
+{
+	lb->blk[b]->pok = 0;
+	for (int i = lb->ptree_n ? lb->ptree_n + b : 0; i; i >>= 1)
+		lb->ptree[i][0][1] = 1;
+}
+
+/* the first block from b in direction dir, under tree node i covering
+blocks lo to hi, in which dep of bracket kind t may reach zero; dep is
+moved past the blocks skipped */
+static int lbuf_pfind(struct lbuf *lb, int i, int lo, int hi, int b, int dir, int t, int *dep)
+{
+	int m = (lo + hi) / 2, r;
+	if (dir > 0 ? hi <= b : lo > b)
+		return -1;
+	if (dir > 0 ? lo >= b : hi <= b + 1) {
+		int (*q)[2] = lbuf_pnode(lb, i);
+		if (*dep + q[t][1] - (dir > 0 ? 0 : q[t][0]) > 0) {
+			*dep += dir * q[t][0];
+			return -1;
+		}
+		if (hi - lo == 1)
+			return lo;
+	}
+	if (dir > 0 && (r = lbuf_pfind(lb, i * 2, lo, m, b, dir, t, dep)) >= 0)
+		return r;
+	if ((r = lbuf_pfind(lb, i * 2 + 1, m, hi, b, dir, t, dep)) >= 0 || dir > 0)
+		return r;
+	return lbuf_pfind(lb, i * 2, lo, m, b, dir, t, dep);
+}
+
+/* find the bracket matching the one at or after off in row; for the
+brackets in lbuf_brk, a tree of block counts finds the block of the
+match in logarithmic time */
 int lbuf_pair(struct lbuf *lb, char *pairs, int plen, int *row, int *off)
 {
 	int r = *row, o = *off;
-	int p, c, dep = 1;
-	char *m;
-	if (!lbuf_get(lb, r))
+	int p, dep = 1, dir, t = -1, b, i, x, len, c0, c1;
+	char *m, *s;
+	struct lblk *k;
+	if (!(s = lbuf_get(lb, r)))
 		return 1;
-	ren_state *rs = ren_position(lbuf_get(lb, r));
+	ren_state *rs = ren_position(s);
 	for (; o < rs->n-1 && !memchr(pairs, *rs->chrs[o], plen); o++);
 	if (!(m = memchr(pairs, *rs->chrs[o], plen)))
 		return 1;
 	p = m - pairs;
-	while (!lbuf_next(lb, (p & 1) ? -1 : +1, &r, &o)) {
-		c = *rstate->chrs[o];
-		if (c == pairs[p ^ 1])
-			dep--;
-		if (c == pairs[p])
-			dep++;
-		if (!dep) {
-			*row = r;
-			*off = o;
-			return 0;
+	dir = p & 1 ? -1 : 1;
+	c0 = pairs[p];
+	c1 = pairs[p ^ 1];
+	if ((m = memchr(lbuf_brk, pairs[p & ~1], 6)) && !((m - lbuf_brk) & 1)
+			&& m[1] == pairs[p | 1])
+		t = (m - lbuf_brk) / 2;
+	len = lbuf_s(s)->len;
+	x = rs->chrs[o] - s;
+	if ((x = dir > 0 ? lbuf_pscan(s, x + MAX(1, uc_len(rs->chrs[o])), len, dir, c0, c1, &dep)
+			: lbuf_pscan(s, 0, x, dir, c0, c1, &dep)) >= 0)
+		goto found;
+	b = lbuf_blk(lb, r, &i);
+	if (t >= 0 && !lb->ptree_n)
+		lbuf_ptreemake(lb);
+	while (1) {
+		for (k = lbuf_k(lb, b), i += dir; i >= 0 && i < k->n; i += dir) {
+			r += dir;
+			s = lbuf_text(lb, k->ln[i], &len);
+			if ((x = lbuf_pscan(s, 0, len, dir, c0, c1, &dep)) >= 0)
+				goto found;
 		}
+		if (t < 0)
+			b += dir;
+		else
+			b = lbuf_pfind(lb, 1, 0, lb->ptree_n, b + dir, dir, t, &dep);
+		if (b < 0 || b >= lb->blk_n)
+			return 1;
+		for (r = 0, i = b; i > 0; i -= i & -i)
+			r += lb->fen[i];
+		i = dir > 0 ? -1 : lb->blk[b]->n;
+		r += i;
 	}
-	return 1;
+found:
+	*row = r;
+	*off = uc_off(s, x);
+	return 0;
 }
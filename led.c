@@ -39,7 +39,7 @@ static void file_index(struct lbuf *buf)
 {
 	char reg[] = "[^\t !-/:-@[-\\]^`{-\x7f]+";
 	int len, sidx, grp = xgrp;
-	char **ss = buf->ln;
+	char *s;
 	int ln_n = lbuf_len(buf), n;
 	rset *rs = rset_smake(xacreg ? xacreg->s : reg,
 		xic ? REG_ICASE | REG_NEWLINE : REG_NEWLINE);
@@ -51,8 +51,9 @@ static void file_index(struct lbuf *buf)
 		if (acsb->s[n - 1] == '\n')
 			sbuf_mem(ibuf, &n, sizeof(n))
 	for (int i = 0; i < ln_n; i++) {
+		s = lbuf_raw(buf, i, &len);
 		sidx = 0;
-		while (rset_find(rs, ss[i]+sidx, subs, sidx ? REG_NOTBOL : 0) >= 0) {
+		while (rset_find(rs, s+sidx, subs, sidx ? REG_NOTBOL : 0) >= 0) {
 			/* if target group not found, continue with group 1
 			which will always be valid, otherwise there be no match */
 			if (subs[grp] < 0) {
@@ -61,7 +62,7 @@ static void file_index(struct lbuf *buf)
 			}
 			len = subs[grp + 1] - subs[grp];
 			if (len > 1) {
-				char *part = ss[i]+sidx+subs[grp];
+				char *part = s+sidx+subs[grp];
 				int *ip = (int*)(ibuf->s+sizeof(n));
 				for (n = len+1; ip < (int*)&ibuf->s[ibuf->s_n]; ip++)
 					if (*ip - ip[-1] == n &&
@@ -679,7 +680,7 @@ int led_prompt(sbuf *sb, char *insert, int *kmap, ins_state *is, int ps, int flg
 	restore(xtd)
 	restore(xleft)
 	if (key == '\n' && flg & 1) {
-		lbuf_dedup(tempbufs[0].lb, sb->s + n, sb->s_n - n)
+		lbuf_dedup(tempbufs[0].lb, sb->s + n, sb->s_n - n);
 		temp_pos(0, -1, 0, 0);
 		temp_write(0, sb->s + n);
 	}
@@ -49,11 +49,15 @@ pc += num;
 
 static int re_sizecode(char *re, int *nsub, int *laidx, int flg);
 static int reg_comp(rcode *prog, char *re, int nsubc, int laidx, int flg);
+static void re_dfree(struct rdfa *dfa);
+static void reg_nopre(rcode *prog);
 
 static void reg_free(rcode *p)
 {
 	for (int i = 0; i < p->laidx; i++)
 		reg_free(p->la[i]);
+	re_dfree(p->dfa);
+	free(p->memo);
 	free(p->la);
 	free(p);
 }
@@ -174,6 +178,8 @@ static int compilecode(char *re_loc, rcode *prog, int sizecode, int flg)
 						prog->la[prog->laidx] = (rcode*)p;
 						prog->la[prog->laidx]->laidx = 0;
 						prog->la[prog->laidx]->la = NULL;
+						prog->la[prog->laidx]->dfa = NULL;
+						prog->la[prog->laidx]->memo = NULL;
 						for (p += sizeof(rcode), re++; re != s;) {
 							if (*re == '\\')
 								re += (s - re) > 1;
@@ -189,6 +195,8 @@ static int compilecode(char *re_loc, rcode *prog, int sizecode, int flg)
 							reg_free(prog->la[prog->laidx]);
 							return -1;
 						}
+						/* re_look() runs it at given positions */
+						reg_nopre(prog->la[prog->laidx]);
 					}
 					*s = ')';
 				}
@@ -358,8 +366,157 @@ static int re_sizecode(char *re, int *nsub, int *laidx, int flg)
 	return res < 0 ? res : dummyprog.unilen;
 }
 
+/* the size of the instruction at insts[i] */
+static int reg_isize(int *insts, int i)
+{
+	switch (insts[i]) {
+	case CLASS:
+		return insts[i+2] * 2 + 3;
+	case LOOKAROUND:
+		return 5;
+	case CHAR:
+	case SAVE:
+	case JMP:
+	case SPLIT:
+	case RSPLIT:
+		return 2;
+	}
+	return 1;
+}
+
+/* find the longest run of ascii characters that every match contains */
+static void reg_lit(rcode *prog)
+{
+	int *insts = prog->insts, n = prog->unilen;
+	int i, t, cov = 0, head = 1, runhead = 0, len = 0, best = 0;
+	int *skip = emalloc((n + 1) * sizeof(skip[0]));
+	char run[sizeof(prog->lit)];
+	memset(skip, 0, (n + 1) * sizeof(skip[0]));
+	/* instructions jumped over by a forward jump or split are optional */
+	for (i = 0; i < n; i += reg_isize(insts, i))
+		if (insts[i] >= JMP && (t = i + 2 + insts[i+1]) > i + 2) {
+			skip[i+2]++;
+			skip[t]--;
+		}
+	prog->lit[0] = '\0';
+	prog->lithead = 0;
+	for (i = 0;; i += reg_isize(insts, i)) {
+		cov += skip[i];
+		if (i < n && !cov && insts[i] == CHAR
+				&& insts[i+1] > 0 && insts[i+1] < 128) {
+			if (!len)
+				runhead = head;
+			if (len < (int)sizeof(run) - 1)
+				run[len++] = insts[i+1];
+		} else if (i == n || cov || insts[i] < WBEG || insts[i] >= JMP) {
+			if (len > best) {
+				best = len;
+				memcpy(prog->lit, run, len);
+				prog->lit[len] = '\0';
+				prog->lithead = runhead;
+			}
+			len = 0;
+			head = 0;
+		}
+		if (i == n)
+			break;
+	}
+	free(skip);
+}
+
+/* mark the bytes a match may start with */
+static void reg_first(rcode *prog)
+{
+	int *insts = prog->insts, n = prog->unilen, i, c, sn = 0;
+	int *stk = emalloc((n + 1) * sizeof(stk[0]));
+	char *seen = emalloc(n + 1);
+	memset(seen, 0, n + 1);
+	memset(prog->first, 0, sizeof(prog->first));
+	stk[sn++] = 0;
+	seen[0] = 1;
+	#define reg_mark(b) prog->first[(b) >> 3] |= 1 << ((b) & 7);
+	#define reg_push(t) if (!seen[t]) { seen[t] = 1; stk[sn++] = t; }
+	while (sn) {
+		i = stk[--sn];
+		switch (i < n ? insts[i] : MATCH) {
+		case CHAR:
+			if ((c = insts[i+1]) >= 128) {
+				for (c = 128; c < 256; c++)
+					reg_mark(c)
+			} else if (c > 0) {
+				reg_mark(tolower(c))
+				reg_mark(toupper(c))
+			}
+			break;
+		case CLASS:
+			if (insts[i+1]) {
+				memset(prog->first, 0xff, sizeof(prog->first));
+				break;
+			}
+			for (c = 0; c < insts[i+2] * 2; c += 2)
+				for (unsigned int b = insts[i+3+c]; b <= (unsigned int)insts[i+4+c]; b++) {
+					if (b >= 128) {
+						for (b = 128; b < 256; b++)
+							reg_mark(b)
+						break;
+					}
+					reg_mark(tolower(b))
+					reg_mark(toupper(b))
+				}
+			break;
+		case ANY:
+		case MATCH:
+			memset(prog->first, 0xff, sizeof(prog->first));
+			break;
+		case BOL:
+			/* the backtracker always tries the beginning of the line */
+			break;
+		case JMP:
+			reg_push(i + 2 + insts[i+1])
+			break;
+		case SPLIT:
+		case RSPLIT:
+			reg_push(i + 2 + insts[i+1])
+			reg_push(i + 2)
+			break;
+		default:
+			/* zero-width assertions */
+			reg_push(i + reg_isize(insts, i))
+		}
+	}
+	#undef reg_mark
+	#undef reg_push
+	free(stk);
+	free(seen);
+}
+
+/* let a match start anywhere and need no literal */
+static void reg_nopre(rcode *prog)
+{
+	prog->lit[0] = '\0';
+	prog->lithead = 0;
+	memset(prog->first, 0xff, sizeof(prog->first));
+}
+
+/* number the instructions the backtracker may reach by more than one path */
+static void reg_memo(rcode *prog)
+{
+	int *insts = prog->insts, n = prog->unilen, i;
+	prog->memo = emalloc((n + 3) * sizeof(prog->memo[0]));
+	for (i = 0; i < n + 3; i++)
+		prog->memo[i] = -1;
+	prog->memo[0] = 0;
+	for (i = 0; i < n; i += reg_isize(insts, i))
+		if (insts[i] >= JMP)
+			prog->memo[i + 2 + insts[i+1]] = 0;
+	for (i = 0, prog->nmemo = 0; i < n + 3; i++)
+		if (!prog->memo[i])
+			prog->memo[i] = prog->nmemo++;
+}
+
 static int reg_comp(rcode *prog, char *re, int nsubc, int laidx, int flg)
 {
+	int i;
 	prog->len = 0;
 	prog->unilen = 0;
 	prog->sub = 0;
@@ -367,13 +524,40 @@ static int reg_comp(rcode *prog, char *re, int nsubc, int laidx, int flg)
 	prog->splits = 0;
 	prog->laidx = 0;
 	prog->flg = flg;
+	prog->nfa = 0;
+	prog->btrack = 1;
+	prog->dfa = NULL;
+	prog->memo = NULL;
 	prog->la = laidx ? emalloc(laidx * sizeof(rcode*)) : NULL;
 	if (compilecode(re, prog, 0, flg) < 0)
 		return -1;
+	reg_lit(prog);
+	reg_memo(prog);
+	reg_first(prog);
+	/* $ and lookarounds depend on text around the match, which the
+	prefilter cannot tell apart, so they get no prefilter at all */
+	for (i = 0; i < prog->unilen; i += reg_isize(prog->insts, i))
+		if (prog->insts[i] == EOL || prog->insts[i] == LOOKAROUND) {
+			reg_nopre(prog);
+			break;
+		}
 	int icnt = 0, scnt = SPLIT;
-	for (int i = 0; i < prog->unilen; i++)
+	for (i = 0; i < prog->unilen; i++)
 		switch (prog->insts[i]) {
+		case WBEG:
+		case WEND:
+			prog->nfa = 1;
+			break;
+		case BOL:	/* the dfa handles ^ only at the start */
+			prog->nfa |= i > 0;
+			prog->btrack &= !i;
+			break;
+		case EOL:	/* and $ only at the end */
+			prog->nfa |= i < prog->unilen - 1;
+			break;
 		case LOOKAROUND:
+			prog->nfa = 1;
+			prog->btrack = 0;
 			i += 4;
 			break;
 		case CLASS:
@@ -388,8 +572,9 @@ static int reg_comp(rcode *prog, char *re, int nsubc, int laidx, int flg)
 		case RSPLIT:
 			prog->insts[i] = -scnt;
 			scnt += 2;
-		case JMP:
 		case SAVE:
+			prog->btrack = 0;
+		case JMP:
 		case CHAR:
 			i++;
 		case ANY:
@@ -401,7 +586,8 @@ static int reg_comp(rcode *prog, char *re, int nsubc, int laidx, int flg)
 	prog->splits = MAX((scnt - SPLIT) / 2, 1);
 	prog->len = icnt + 3;
 	prog->presub = sizeof(rsub) + (sizeof(char*) * (nsubc + 1) * 2);
-	prog->sub = prog->presub * (icnt + 6);
+	/* a sub for each thread of both lists, each pending split and the match */
+	prog->sub = prog->presub * (prog->len * 2 + prog->splits + 3);
 	prog->sparsesz = scnt;
 	return 0;
 }
@@ -525,30 +711,7 @@ if (spc > JMP) { \
 	npc += 2 + npc[1]; \
 	goto rec##nn; \
 } else if (spc == LOOKAROUND) { \
-	if ((npc[1] & 3) < 2) \
-		s0 = _sp; \
-	else if (npc[4] < 0) \
-		s0 = s; \
-	else if (npc[4]) { \
-		s0 = _sp - npc[4]; \
-		if (s0 < s) { \
-			cnt = 0; \
-			goto out##nn; \
-		} \
-	} else \
-		s0 = sp; \
-	j = npc[2]; \
-	if (npc[3]) { \
-		s1 = (char*)(prog->la[j]+1); \
-		for (j = npc[3], cnt = 0; cnt < j && s0[cnt] == s1[cnt]; cnt++); \
-		cnt = cnt == j; \
-	} else if (!lb[j] || s0 > lb[j]) { \
-		cnt = re_pikevm(prog->la[j], s0, _subp, 2, 0); \
-		lb[j] = cnt ? _subp[0] : NULL; \
-	} else \
-		cnt = !!lb[j]; \
-	out##nn: \
-	if (npc[1] * ((cnt << 1) - 1) < 0) \
+	if (!re_look(prog, npc, s, sp, _sp, lb)) \
 		deccheck(nn) \
 	npc += 5; goto rec##nn; \
 } else { \
@@ -626,20 +789,87 @@ for (;; sp = _sp) { \
 } \
 _return(0) \
 
+static int re_pikevm(rcode *prog, const char *s, const char **subp, int nsubc, int flg);
+
+/* whether the lookaround at npc holds at _sp, after the character at sp;
+lb caches the start of the last match of each lookaround expression */
+static int re_look(rcode *prog, int *npc, const char *s, const char *sp,
+		const char *_sp, const char **lb)
+{
+	const char *s0, *s1, *_subp[2];
+	int j, cnt;
+	if ((npc[1] & 3) < 2)
+		s0 = _sp;
+	else if (npc[4] < 0)
+		s0 = s;
+	else if (npc[4]) {
+		s0 = _sp - npc[4];
+		if (s0 < s)
+			return npc[1] < 0;
+	} else
+		s0 = sp;
+	j = npc[2];
+	if (npc[3]) {
+		s1 = (char*)(prog->la[j]+1);
+		for (j = npc[3], cnt = 0; cnt < j && s0[cnt] == s1[cnt]; cnt++);
+		cnt = cnt == j;
+	} else if (!lb[j] || s0 > lb[j]) {
+		cnt = re_pikevm(prog->la[j], s0, _subp, 2, 0);
+		lb[j] = cnt ? _subp[0] : NULL;
+	} else
+		cnt = !!lb[j];
+	return npc[1] * ((cnt << 1) - 1) > 0;
+}
+
+/* the first occurrence of the literal of prog in s */
+static const char *re_lit(rcode *prog, const char *s, int flg)
+{
+	const char *lit = prog->lit;
+	char set[4] = {lit[0]}, *p = set + 1;
+	int i, eol = flg & REG_NEWLINE ? '\n' : 0;
+	if (flg & REG_ICASE) {
+		set[0] = tolower((unsigned char)lit[0]);
+		*p++ = toupper((unsigned char)lit[0]);
+	}
+	/* lines may be raw text that is not nul-terminated */
+	if (eol)
+		*p++ = eol;
+	*p = '\0';
+	for (; (s = strpbrk(s, set)) && *s != eol; s++) {
+		for (i = 1; lit[i] && s[i] != eol; i++)
+			if (flg & REG_ICASE ? tolower((unsigned char)s[i])
+					!= tolower((unsigned char)lit[i])
+					: s[i] != lit[i])
+				break;
+		if (!lit[i])
+			return s;
+	}
+	return NULL;
+}
+
 static int re_pikevm(rcode *prog, const char *s, const char **subp, int nsubc, int flg)
 {
 	if (!*s)
 		return 0;
 	flg = prog->flg | flg;
-	const char *sp = s, *_sp = s, *s0, *s1;
+	const char *sp = s, *_sp = s, *s0;
+	if (prog->lit[0]) {
+		/* skip inputs that cannot match and the text before the literal */
+		if (!(s0 = re_lit(prog, s, flg)))
+			return 0;
+		if (prog->lithead && s0 > s) {
+			_sp = s0;
+			sp = uc_beg((char*)s, (char*)s0 - 1);
+		}
+	}
 	int *pcs[prog->splits], *npc, *pc, *insts = prog->insts;
 	rsub *subs[prog->splits];
 	rsub *nsub, *sub, *matched = NULL, *freesub = NULL;
 	rthread _clist[prog->len], _nlist[prog->len];
 	rthread *clist = _clist, *nlist = _nlist, *tmp;
-	const char *_subp[2], *lb[prog->laidx+1];
+	const char *lb[prog->laidx+1];
 	int rsubsize = prog->presub, suboff = 0;
-	int cnt, spc, i, c, j, osubp = nsubc * sizeof(char*);
+	int cnt, spc, i, c, osubp = nsubc * sizeof(char*);
 	int si = 0, clistidx = 0, nlistidx, mcont = MATCH;
 	int eol_ch = flg & REG_NEWLINE ? '\n' : 0;
 	unsigned int sdense[prog->sparsesz], sparsesz = 0;
@@ -655,6 +885,419 @@ static int re_pikevm(rcode *prog, const char *s, const char **subp, int nsubc, i
 	match(2,)
 }
 
+#define RB_BITS		(256 * 1024)	/* largest visited bitmap of the backtracker */
+#define RB_LEN		2048	/* longest input window of the backtracker */
+
+/* a backtracking job; negative pc restores save -pc-1 to pos */
+struct rbjob {
+	int pc, pos, prev;
+};
+static struct rbjob *rb_jobs;
+static int rb_jobsz;
+
+#define rb_push(_pc, _pos, _prev) { \
+if (sn == rb_jobsz) { \
+	rb_jobsz = rb_jobsz ? rb_jobsz * 2 : 1024; \
+	rb_jobs = erealloc(rb_jobs, rb_jobsz * sizeof(rb_jobs[0])); \
+} \
+rb_jobs[sn].pc = _pc; \
+rb_jobs[sn].pos = _pos; \
+rb_jobs[sn++].prev = _prev; } \
+
+/* decode the characters up to p and clear their visited bits */
+#define rb_dec(p) \
+while (!fin && (p) - base >= ndec) { \
+	if (ndec >= win) \
+		goto fail; \
+	sp = s0 + ndec; \
+	uc_code(c, sp, l) \
+	for (i = 1; i < l && utf8_length[(unsigned char)sp[i]]; i++); \
+	if (i < l) \
+		goto fail; \
+	if (flg & REG_ICASE && (unsigned int)c < 128) \
+		c = tolower(c); \
+	cs[ndec] = c; \
+	cl[ndec] = l; \
+	for (bit = ((ndec + MAX(l, 1)) * prog->nmemo + 31) / 32; nclr < bit;) \
+		vis[nclr++] = 0; \
+	fin = !l; \
+	ndec += l; \
+} \
+
+/* like re_pikevm(), by backtracking over a bitmap of visited (pc, pos)
+pairs; return -1 if the match needs more input than the bitmap covers */
+static int re_btrack(rcode *prog, const char *s, const char **subp, int nsubc, int flg)
+{
+	const char *s0 = s, *sp;
+	int *insts = prog->insts, *memo = prog->memo, ncap, base, bit;
+	int i, l, c, op, pc, pos, prev, sn, start, sprev, ret = 0;
+	int win, ndec = 0, nclr = 0, fin = 0;
+	if (!*s)
+		return 0;
+	flg = prog->flg | flg;
+	if (prog->lit[0]) {
+		if (!(s0 = re_lit(prog, s, flg)))
+			return 0;
+		if (!prog->lithead)
+			s0 = s;
+	}
+	int eol_ch = flg & REG_NEWLINE ? '\n' : 0;
+	if (eol_ch)
+		utf8_length[eol_ch] = 0;
+	/* the input is decoded lazily, so repeated calls on a long
+	line cost only the text each of them examines */
+	win = MIN(RB_LEN, RB_BITS / prog->nmemo);
+	unsigned int vis[(win * prog->nmemo + 31) / 32];
+	int cs[win], cl[win];	/* characters and their lengths */
+	const char *lb[prog->laidx+1];
+	ncap = (prog->presub - sizeof(rsub)) / sizeof(char*);
+	const char *cap[ncap];
+	for (i = 0; i < prog->laidx; i++)
+		lb[i] = NULL;
+	/* failed starts restore every save, so caps are cleared only once */
+	for (i = 0; i < ncap; i++)
+		cap[i] = NULL;
+	base = s0 - s;
+	start = base;
+	sprev = s0 > s ? uc_beg((char*)s, (char*)s0 - 1) - s : start;
+	while (1) {
+		rb_dec(start)
+		if ((start || flg & REG_NOTBOL) && !(prog->first[(unsigned char)s[start] >> 3]
+				& 1 << ((unsigned char)s[start] & 7)))
+			goto next;
+		cap[0] = s + start;
+		sn = 0;
+		rb_push(0, start, sprev)
+		while (sn) {
+			pc = rb_jobs[--sn].pc;
+			pos = rb_jobs[sn].pos;
+			prev = rb_jobs[sn].prev;
+			if (pc < 0) {
+				cap[-pc - 1] = pos < 0 ? NULL : s + pos;
+				continue;
+			}
+			while (1) {
+				if (memo[pc] >= 0) {
+					bit = (pos - base) * prog->nmemo + memo[pc];
+					if (vis[bit >> 5] & (1u << (bit & 31)))
+						break;
+					vis[bit >> 5] |= 1u << (bit & 31);
+				}
+				sp = s + pos;
+				op = insts[pc];
+				if (op > JMP) {
+					rb_push(pc + 2 + insts[pc+1], pos, prev)
+					pc += 2;
+					continue;
+				} else if (op < 0) {
+					rb_push(pc + 2, pos, prev)
+					pc += 2 + insts[pc+1];
+					continue;
+				}
+				if (op == CHAR || op == CLASS || op == ANY) {
+					c = cs[pos - base];
+					if (!(l = cl[pos - base]))
+						break;
+					if (op == CHAR) {
+						if (c != insts[pc+1])
+							break;
+						pc += 2;
+					} else if (op == CLASS) {
+						for (i = 0; i < insts[pc+2]; i++)
+							if (c >= insts[pc+3+i*2] && c <= insts[pc+4+i*2])
+								break;
+						if ((i < insts[pc+2]) == insts[pc+1])
+							break;
+						pc += insts[pc+2] * 2 + 3;
+					} else
+						pc++;
+					prev = pos;
+					pos += l;
+					rb_dec(pos)
+				} else if (op == MATCH) {
+					for (i = 0; i < nsubc; i += 2) {
+						subp[i] = cap[i >> 1];
+						subp[i+1] = cap[(nsubc >> 1) + (i >> 1)];
+					}
+					ret = 1;
+					goto out;
+				} else if (op == SAVE) {
+					rb_push(-insts[pc+1] - 1, cap[insts[pc+1]] ?
+						cap[insts[pc+1]] - s : -1, 0)
+					cap[insts[pc+1]] = sp;
+					pc += 2;
+				} else if (op == JMP) {
+					pc += 2 + insts[pc+1];
+				} else if (op == WBEG) {
+					if (((prev || prev != pos) && isword(s + prev)) || !isword(sp))
+						break;
+					pc++;
+				} else if (op == WEND) {
+					if (isword(sp))
+						break;
+					pc++;
+				} else if (op == EOL) {
+					if (flg & REG_NOTEOL || *sp != eol_ch)
+						break;
+					pc++;
+				} else if (op == BOL) {
+					if (flg & REG_NOTBOL || pos)
+						break;
+					pc++;
+				} else {
+					if (!re_look(prog, insts + pc, s, s + prev, sp, lb))
+						break;
+					pc += 5;
+				}
+			}
+		}
+		next:
+		if (!cl[start - base])
+			break;
+		sprev = start;
+		start += cl[start - base];
+	}
+	goto out;
+	fail:
+	ret = -1;
+	out:
+	if (eol_ch)
+		utf8_length[eol_ch] = 1;
+	return ret;
+}
+
+#define RD_MAX		128	/* dfa states cached before starting over */
+#define RD_HSZ		256	/* dfa state hash table size */
+
+/* a set of pike vm threads, as a state of the lazily built dfa */
+struct rdstate {
+	struct rdstate *next[256];	/* transitions on characters below 256 */
+	struct rdstate *hnext;		/* next state in the hash chain */
+	unsigned h;
+	int match;			/* a thread has matched */
+	int eolmatch[2];		/* a thread matches if $ (and ^) hold here */
+	int n;				/* number of threads */
+	int pc[];			/* sorted thread instructions */
+};
+
+struct rdfa {
+	struct rdstate *tab[RD_HSZ];
+	struct rdstate *start[2];	/* initial states without and with ^ */
+	int n;				/* number of states */
+	int sz;				/* number of instructions */
+	unsigned stamp;			/* mark of instructions in the set */
+	unsigned *mark;
+	int *stk, *set;
+};
+
+static void re_dflush(struct rdfa *dfa)
+{
+	struct rdstate *st, *nx;
+	for (int i = 0; i < RD_HSZ; i++)
+		for (st = dfa->tab[i], dfa->tab[i] = NULL; st; st = nx) {
+			nx = st->hnext;
+			free(st);
+		}
+	dfa->start[0] = NULL;
+	dfa->start[1] = NULL;
+	dfa->n = 0;
+}
+
+static void re_dfree(struct rdfa *dfa)
+{
+	if (!dfa)
+		return;
+	re_dflush(dfa);
+	free(dfa->mark);
+	free(dfa->stk);
+	free(dfa->set);
+	free(dfa);
+}
+
+static struct rdfa *re_dmake(rcode *prog)
+{
+	struct rdfa *dfa = emalloc(sizeof(*dfa));
+	int n = prog->unilen;
+	memset(dfa, 0, sizeof(*dfa));
+	dfa->sz = n;
+	dfa->mark = emalloc(n * sizeof(dfa->mark[0]));
+	memset(dfa->mark, 0, n * sizeof(dfa->mark[0]));
+	dfa->stk = emalloc((n * 2 + 2) * sizeof(dfa->stk[0]));
+	dfa->set = emalloc(n * 2 * sizeof(dfa->set[0]));
+	return dfa;
+}
+
+static void re_dstamp(struct rdfa *dfa)
+{
+	if (!++dfa->stamp) {
+		memset(dfa->mark, 0, dfa->sz * sizeof(dfa->mark[0]));
+		dfa->stamp = 1;
+	}
+}
+
+/* append the threads reachable from pc to set[n]; return the new size */
+static int re_dadd(rcode *prog, struct rdfa *dfa, int n, int pc, int bol, int eol)
+{
+	int *insts = prog->insts, *stk = dfa->stk, sn = 0, op;
+	stk[sn++] = pc;
+	while (sn) {
+		pc = stk[--sn];
+		if (dfa->mark[pc] == dfa->stamp)
+			continue;
+		dfa->mark[pc] = dfa->stamp;
+		op = insts[pc];
+		if (op > JMP || op < 0) {
+			stk[sn++] = pc + 2 + insts[pc+1];
+			stk[sn++] = pc + 2;
+		} else if (op == JMP)
+			stk[sn++] = pc + 2 + insts[pc+1];
+		else if (op == SAVE)
+			stk[sn++] = pc + 2;
+		else if (op == BOL || (op == EOL && eol)) {
+			if (op == EOL || bol)
+				stk[sn++] = pc + 1;
+		} else
+			dfa->set[n++] = pc;
+	}
+	return n;
+}
+
+/* the state of the n threads in set; NULL if the cache is full */
+static struct rdstate *re_dstate(rcode *prog, struct rdfa *dfa, int n)
+{
+	int *set = dfa->set, i, j, m, pc;
+	unsigned h = 2166136261u;
+	struct rdstate *st;
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && set[j-1] > set[j]; j--) {
+			pc = set[j];
+			set[j] = set[j-1];
+			set[j-1] = pc;
+		}
+	for (i = 0; i < n; i++)
+		h = (h ^ set[i]) * 16777619u;
+	for (st = dfa->tab[h % RD_HSZ]; st; st = st->hnext)
+		if (st->h == h && st->n == n && !memcmp(st->pc, set, n * sizeof(set[0])))
+			return st;
+	if (dfa->n >= RD_MAX)
+		return NULL;
+	st = emalloc(sizeof(*st) + n * sizeof(set[0]));
+	memset(st->next, 0, sizeof(st->next));
+	memcpy(st->pc, set, n * sizeof(set[0]));
+	st->h = h;
+	st->n = n;
+	st->match = 0;
+	for (i = 0; i < n; i++)
+		if (prog->insts[set[i]] == MATCH)
+			st->match = 1;
+	for (j = 0; j < 2; j++) {
+		re_dstamp(dfa);
+		for (i = 0, m = n; i < n; i++)
+			if (prog->insts[set[i]] == EOL)
+				m = re_dadd(prog, dfa, m, set[i] + 1, j, 1);
+		for (st->eolmatch[j] = 0; m > n; m--)
+			if (prog->insts[set[m - 1]] == MATCH)
+				st->eolmatch[j] = 1;
+	}
+	st->hnext = dfa->tab[h % RD_HSZ];
+	dfa->tab[h % RD_HSZ] = st;
+	dfa->n++;
+	return st;
+}
+
+static struct rdstate *re_dstart(rcode *prog, struct rdfa *dfa, int bol)
+{
+	if (!dfa->start[bol]) {
+		re_dstamp(dfa);
+		int n = re_dadd(prog, dfa, 0, 0, bol, 0);
+		if (!(dfa->start[bol] = re_dstate(prog, dfa, n))) {
+			re_dflush(dfa);
+			dfa->start[bol] = re_dstate(prog, dfa, n);
+		}
+	}
+	return dfa->start[bol];
+}
+
+/* the state after st reads c, with a new thread starting after it */
+static struct rdstate *re_dstep(rcode *prog, struct rdfa *dfa, struct rdstate *st, int c)
+{
+	int *insts = prog->insts, i, j, n = 0, pc;
+	struct rdstate *nx;
+	re_dstamp(dfa);
+	for (i = 0; i < st->n; i++) {
+		pc = st->pc[i];
+		if (insts[pc] == CHAR) {
+			if (insts[pc+1] != c)
+				continue;
+			pc += 2;
+		} else if (insts[pc] == CLASS) {
+			for (j = 0; j < insts[pc+2]; j++)
+				if (c >= insts[pc+3+j*2] && c <= insts[pc+4+j*2])
+					break;
+			if ((j < insts[pc+2]) == insts[pc+1])
+				continue;
+			pc += insts[pc+2] * 2 + 3;
+		} else if (insts[pc] == ANY)
+			pc++;
+		else
+			continue;
+		n = re_dadd(prog, dfa, n, pc, 0, 0);
+	}
+	n = re_dadd(prog, dfa, n, 0, 0, 0);
+	if (!(nx = re_dstate(prog, dfa, n))) {
+		re_dflush(dfa);
+		return re_dstate(prog, dfa, n);
+	}
+	if ((unsigned int)c < 256)
+		st->next[c] = nx;
+	return nx;
+}
+
+/* like re_pikevm() without submatches, by running a lazy dfa */
+static int re_dfa(rcode *prog, const char *s, int flg)
+{
+	const char *sp = s, *s0;
+	struct rdstate *st, *nx;
+	int c, l, ret;
+	if (!*s)
+		return 0;
+	flg = prog->flg | flg;
+	if (prog->lit[0]) {
+		if (!(s0 = re_lit(prog, s, flg)))
+			return 0;
+		if (prog->lithead)
+			sp = s0;
+	}
+	if (!prog->dfa)
+		prog->dfa = re_dmake(prog);
+	int eol_ch = flg & REG_NEWLINE ? '\n' : 0;
+	if (eol_ch)
+		utf8_length[eol_ch] = 0;
+	st = re_dstart(prog, prog->dfa, sp == s && !(flg & REG_NOTBOL));
+	while (1) {
+		if (st->match || !st->n) {
+			ret = st->match;
+			break;
+		}
+		uc_code(c, sp, l)
+		if (!l) {
+			ret = st->eolmatch[sp == s && !(flg & REG_NOTBOL)]
+				&& !(flg & REG_NOTEOL) && *sp == eol_ch;
+			break;
+		}
+		if (flg & REG_ICASE && (unsigned int)c < 128)
+			c = tolower(c);
+		if ((unsigned int)c < 256 && (nx = st->next[c]))
+			st = nx;
+		else
+			st = re_dstep(prog, prog->dfa, st, c);
+		sp += l;
+	}
+	if (eol_ch)
+		utf8_length[eol_ch] = 1;
+	return ret;
+}
+
 static int re_groupcount(char *s)
 {
 	int n;
@@ -666,15 +1309,26 @@ static int re_groupcount(char *s)
 	return n;
 }
 
+#define RS_CACHE	16	/* recently compiled rsets kept for reuse */
+
+/* compiled rsets, the most recently used first */
+static struct rscache {
+	char *key;	/* each pattern after a byte telling if it is NULL */
+	int len;	/* key length */
+	int flg;
+	rset *rs;
+} rs_cache[RS_CACHE];
+static int rs_cachen;
+
 void rset_free(rset *rs)
 {
-	if (!rs)
+	if (!rs || --rs->ref)
 		return;
 	reg_free(rs->regex);
 	free(rs);
 }
 
-rset *rset_make(int n, char **re, int flg)
+static rset *rset_comp(int n, char **re, int flg)
 {
 	int i, laidx, sz, nsubc, c = 0;
 	rset *rs = emalloc(sizeof(*rs) + (((n + 1) * sizeof(rs->grp[0])) * 2));
@@ -708,6 +1362,7 @@ rset *rset_make(int n, char **re, int flg)
 		rs->regex = emalloc(sizeof(rcode) + (sz * sizeof(int)));
 		if (!reg_comp(rs->regex, sb->s, nsubc, laidx, flg)) {
 			rs->nsubc = (nsubc + 1) * 2;
+			rs->ref = 1;
 			free(sb->s);
 			return rs;
 		}
@@ -718,12 +1373,65 @@ rset *rset_make(int n, char **re, int flg)
 	return NULL;
 }
 
+/* compile the patterns or reuse a cached rset; rset_free() releases it */
+rset *rset_make(int n, char **re, int flg)
+{
+	struct rscache rc;
+	int i;
+	sbuf_smake(key, 256)
+	for (i = 0; i < n; i++) {
+		sbuf_chr(key, !re[i])
+		if (re[i])
+			sbuf_mem(key, re[i], strlen(re[i]) + 1)
+	}
+	for (i = 0; i < rs_cachen; i++)
+		if (rs_cache[i].flg == flg && rs_cache[i].len == key->s_n
+				&& !memcmp(rs_cache[i].key, key->s, key->s_n))
+			break;
+	if (i < rs_cachen) {
+		free(key->s);
+		rc = rs_cache[i];
+	} else {
+		if (!(rc.rs = rset_comp(n, re, flg))) {
+			free(key->s);
+			return NULL;
+		}
+		rc.key = key->s;
+		rc.len = key->s_n;
+		rc.flg = flg;
+		if (i == RS_CACHE) {
+			i--;
+			free(rs_cache[i].key);
+			rset_free(rs_cache[i].rs);
+		} else
+			rs_cachen++;
+	}
+	memmove(rs_cache + 1, rs_cache, i * sizeof(rs_cache[0]));
+	rs_cache[0] = rc;
+	rc.rs->ref++;
+	return rc.rs;
+}
+
 /* return the index of the matching regular expression or -1 if none matches */
 int rset_find(rset *rs, char *s, int *grps, int flg)
 {
 	const char *subs[rs->nsubc+2];
 	const char **sub = subs+2;
-	if (re_pikevm(rs->regex, s, sub, rs->nsubc, flg)) {
+	int ret = rs->regex->btrack ? re_btrack(rs->regex, s, sub, rs->nsubc, flg) : -1;
+	if (ret < 0)
+		ret = re_pikevm(rs->regex, s, sub, rs->nsubc, flg);
+#ifdef REG_CHECK
+	/* cbuild.sh regcheck: compare with the pike vm */
+	else {
+		const char *chk[rs->nsubc+1];
+		if (ret != re_pikevm(rs->regex, s, chk, rs->nsubc, flg) ||
+				(ret && memcmp(chk, sub, rs->nsubc * sizeof(sub[0])))) {
+			fprintf(stderr, "rset_find: backtracker differs on \"%s\"\n", s);
+			abort();
+		}
+	}
+#endif
+	if (ret) {
 		subs[1] = NULL; /* make sure sub[-1] never matches */
 		for (int i = rs->n-1; i >= 0; i--) {
 			if (sub[rs->grp[i] + 1]) {
@@ -747,5 +1455,15 @@ int rset_find(rset *rs, char *s, int *grps, int flg)
 
 int rset_match(rset *rs, char *s, int flg)
 {
-	return re_pikevm(rs->regex, s, NULL, 0, flg);
+	if (rs->regex->nfa)
+		return re_pikevm(rs->regex, s, NULL, 0, flg);
+	int ret = re_dfa(rs->regex, s, flg);
+#ifdef REG_CHECK
+	/* cbuild.sh regcheck: compare with the pike vm */
+	if (ret != re_pikevm(rs->regex, s, NULL, 0, flg)) {
+		fprintf(stderr, "rset_match: dfa differs on \"%s\"\n", s);
+		abort();
+	}
+#endif
+	return ret;
 }
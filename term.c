@@ -137,9 +137,13 @@ void term_push(char *s, unsigned int n)
 	ibuf_cnt += n;
 }
 
+#define FOLLOW_MS	250	/* how often a followed file is checked */
+/* keys that may run before a file is fully loaded */
+#define TERM_NAV	"hjklwbeWBE0123456789^$ \b\r\n+-HMLz\x04\x05\x06\x02\x15\x19"
+
 int term_read(int winch)
 {
-	static struct pollfd ufd = {STDIN_FILENO, POLLIN};
+	static struct pollfd ufd[2] = {{STDIN_FILENO, POLLIN}, {-1, POLLIN}};
 	int cw;
 	if (ibuf_pos >= ibuf_cnt) {
 		if (texec) {
@@ -153,9 +157,26 @@ int term_read(int winch)
 		}
 		cw = 0;
 		re:
+		while (!icmd_pos && !(xvis & 2) && xquit >= 0
+				&& lbuf_load(0) >= 0 && !poll(ufd, 1, 0))
+			vi_load();
+		/* then compress lines left unused */
+		for (lbuf_cold(NULL, 0); !icmd_pos && !(xvis & 2) && xquit >= 0
+				&& !poll(ufd, 1, 0) && lbuf_cold(xb, xrow););
+		/* between commands, also wait for background writes */
+		ufd[1].fd = !icmd_pos && !(xvis & 2) ? xwbfd : -1;
+		ufd[1].revents = 0;
+		/* and look for lines appended to a followed file */
+		while (xfl && !icmd_pos && !(xvis & 2) && xquit >= 0
+				&& !poll(ufd, 2, FOLLOW_MS))
+			vi_follow();
 		/* read a single input character */
-		if (xquit < 0 || poll(&ufd, 1, -1) <= 0 ||
+		if (xquit < 0 || poll(ufd, 2, -1) <= 0 || !ufd[0].revents ||
 				read(STDIN_FILENO, ibuf, 1) <= 0) {
+			if (ufd[1].revents && xquit >= 0) {
+				vi_wbdone();
+				goto re;
+			}
 			xquit = !isatty(STDIN_FILENO) ? -1 : xquit;
 			if (term_winch && winch && xquit >= 0) {
 				*ibuf = winch;
@@ -175,6 +196,9 @@ int term_read(int winch)
 		ibuf_cnt = 1;
 		ibuf_pos = 0;
 	}
+	/* commands other than motions need the whole file */
+	if (lbuf_load(0) >= 0 && !memchr(TERM_NAV, ibuf[ibuf_pos], sizeof(TERM_NAV) - 1))
+		lbuf_load(-1);
 	if (icmd_pos < sizeof(icmd))
 		icmd[icmd_pos++] = ibuf[ibuf_pos];
 	return ibuf[ibuf_pos++];
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -12,6 +13,8 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include "vi.h"
 #include "conf.c"
@@ -368,17 +371,23 @@ static char *vi_curword(struct lbuf *lb, int row, int off, int n, int ex)
 	sbufn_ret(sb, sb->s)
 }
 
-static void vi_regput(int c, const char *s, int lnmode)
+/* put the region in register c; whole lines are shared, not copied */
+static void vi_regput(int c, int r1, int o1, int r2, int o2, int lnmode)
 {
-	sbuf *i_s;
+	sbuf rsb;
 	if (lnmode) {
 		for (int i = 8; i > 0; i--)
-			if ((i_s = ex_regget('0'+i)))
-				ex_regput('0' + i + 1, i_s->s, 0);
-		ex_regput('1', s, 0);
-	} else if ((i_s = ex_regget(c)))
-		ex_regput('0', i_s->s, 0);
-	ex_regput(tolower(c), s, isupper(c));
+			ex_regcopy('0' + i + 1, '0' + i);
+		ex_regputln('1', xb, r1, MIN(r2 + 1, lbuf_len(xb)));
+		if (!isupper(c)) {
+			ex_regcopy(c, '1');
+			return;
+		}
+	} else
+		ex_regcopy('0', c);
+	lbuf_region(xb, &rsb, r1, lnmode ? 0 : o1, r2, lnmode ? -1 : o2);
+	ex_regput(tolower(c), rsb.s, isupper(c));
+	free(rsb.s);
 }
 
 rset *fsincl;
@@ -462,7 +471,7 @@ static int fs_search(int cnt, int *row, int *off)
 	int again = 0, ret, len;
 	wrap:
 	while (fspos < lbuf_len(tempbufs[1].lb)) {
-		path = tempbufs[1].lb->ln[fspos++];
+		path = lbuf_get(tempbufs[1].lb, fspos++);
 		fssearch()
 	}
 	if (fspos == lbuf_len(tempbufs[1].lb) && !again) {
@@ -478,7 +487,7 @@ static int fs_searchback(int cnt, int *row, int *off)
 	char *path;
 	int ret, len;
 	while (--fspos >= 0) {
-		path = tempbufs[1].lb->ln[fspos];
+		path = lbuf_get(tempbufs[1].lb, fspos);
 		fssearch()
 	}
 	return 0;
@@ -799,10 +808,7 @@ static int vi_region(int cmd, int *row, int *off)
 
 static void vi_yank(int r1, int o1, int r2, int o2, int lnmode)
 {
-	sbuf rsb;
-	lbuf_region(xb, &rsb, r1, lnmode ? 0 : o1, r2, lnmode ? -1 : o2);
-	vi_regput(vi_ybuf < 0 ? xdefreg : vi_ybuf, rsb.s, lnmode);
-	free(rsb.s);
+	vi_regput(vi_ybuf < 0 ? xdefreg : vi_ybuf, r1, o1, r2, o2, lnmode);
 	xrow = r1;
 	xoff = lnmode ? xoff : o1;
 }
@@ -810,9 +816,7 @@ static void vi_yank(int r1, int o1, int r2, int o2, int lnmode)
 static void vi_delete(int r1, int o1, int r2, int o2, int lnmode)
 {
 	sbuf rsb;
-	lbuf_region(xb, &rsb, r1, lnmode ? 0 : o1, r2, lnmode ? -1 : o2);
-	vi_regput(vi_ybuf < 0 ? xdefreg : vi_ybuf, rsb.s, lnmode);
-	free(rsb.s);
+	vi_regput(vi_ybuf < 0 ? xdefreg : vi_ybuf, r1, o1, r2, o2, lnmode);
 	if (lnmode)
 		lbuf_edit(xb, NULL, r1, r2 + 1, 0, 0);
 	else {
@@ -838,23 +842,20 @@ static int vi_indents(char *ln)
 static int vi_change(int r1, int o1, int r2, int o2, int lnmode)
 {
 	char *post, *ln = lbuf_get(xb, r1);
-	sbuf rsb;
 	int key, tlen, l1, l2 = 1, postn = 1;
 	sbuf_smake(sb, xcols)
+	vi_regput(vi_ybuf < 0 ? xdefreg : vi_ybuf, r1, ln ? o1 : 0, r2, ln ? o2 : -1, lnmode);
+	ln = lbuf_get(xb, r1);	/* the yank may share its record */
 	if (lnmode || !ln) {
 		o1 = l1 = vi_indents(ln);
 		post = "\n";
 		tlen = -1;
-		lbuf_region(xb, &rsb, r1, 0, r2, -1);
 	} else {
-		l1 = uc_chr(ln, o1) - ln;
+		l1 = lbuf_chr(ln, o1) - ln;
 		post = uc_chr(lbuf_get(xb, r2), o2);
 		l2 = uc_chrn(post, -1, &postn) - post;
 		tlen = lbuf_s(ln)->len+1;
-		lbuf_region(xb, &rsb, r1, o1, r2, o2);
 	}
-	vi_regput(vi_ybuf < 0 ? xdefreg : vi_ybuf, rsb.s, lnmode);
-	free(rsb.s);
 	term_pos(r1 - xtop < 0 ? 0 : r1 - xtop, 0);
 	term_room(r1 < xtop ? xtop - xrow : r1 - r2 -
 			(*vi_word && ln && *ln != '\n' && r1 != r2));
@@ -1046,13 +1047,23 @@ static int vc_put(int cmd)
 {
 	int cnt = MAX(1, vi_arg);
 	int i, off;
-	char *ln;
-	sbuf *buf = ex_regget(vi_ybuf < 0 ? xdefreg : vi_ybuf);
-	if (!buf || !buf->s_n) {
+	char *ln, **rl;
+	int reg = vi_ybuf < 0 ? xdefreg : vi_ybuf;
+	sbuf *buf = (rl = ex_reglines(reg, &i)) ? NULL : ex_regget(reg);
+	if (!rl && (!buf || !buf->s_n)) {
 		vi_drawmsg_mpt(buf ? "empty register" : "uninitialized register")
 		return 0;
 	}
 	rep_record()
+	if (rl) {
+		if (!lbuf_len(xb))
+			lbuf_edit(xb, "\n", 0, 0, 0, 0);
+		if (cmd == 'p')
+			xrow++;
+		lbuf_lput(xb, xrow, rl, i, cnt, 0);
+		xoff = lbuf_indents(xb, xrow);
+		return 1;
+	}
 	sbuf_smake(sb, 1024)
 	if (buf->s[buf->s_n-1] == '\n' || strchr(buf->s, '\n')) {
 		for (i = 0; i < cnt; i++)
@@ -1266,7 +1277,7 @@ void vi(int init)
 			case TK_CTL('i'): {
 				if (!(ln = lbuf_get(xb, xrow)))
 					break;
-				ln = uc_chr(ln, xoff);
+				ln = lbuf_chr(ln, xoff);
 				n = strlen(ln);
 				char buf[n + 4];
 				memcpy(buf, ":e ", 3);
@@ -1290,24 +1301,13 @@ void vi(int init)
 				vi_mod |= 1;
 				break;
 			case 'u':
-				undo:
-				if (vi_arg >= 0 && !lbuf_undo(xb, &xrow, &xoff)) {
-					vi_mod |= 1;
-					vi_arg--;
-					goto undo;
-				} else if (!vi_arg)
-					vi_drawmsg_mpt("undo failed")
-				else if (xrow < xtop || xrow >= xtop + xrows)
-					xtop = MAX(0, xrow - xrows / 2);
-				break;
 			case TK_CTL('r'):
-				redo:
-				if (vi_arg >= 0 && !lbuf_redo(xb, &xrow, &xoff)) {
+				/* all steps go in one call, see lbuf_undo() */
+				k = (c == 'u' ? lbuf_undo : lbuf_redo)(xb, &xrow, &xoff, vi_arg + 1);
+				if (k <= vi_arg)
 					vi_mod |= 1;
-					vi_arg--;
-					goto redo;
-				} else if (!vi_arg)
-					vi_drawmsg_mpt("redo failed")
+				if (k == 1)
+					vi_drawmsg_mpt(c == 'u' ? "undo failed" : "redo failed")
 				else if (xrow < xtop || xrow >= xtop + xrows)
 					xtop = MAX(0, xrow - xrows / 2);
 				break;
@@ -1737,6 +1737,11 @@ void vi(int init)
 			}
 		}
 		topfix()
+		/* edits free line records, whose addresses may come back */
+		if (vi_mod & ~4) {
+			rstates[0].s = NULL;
+			rstates[1].s = NULL;
+		}
 		ln = lbuf_get(xb, xrow);
 		xoff = ren_noeol(ln, xoff);
 		if (ln && !rstate->wid[xoff]) {
@@ -1835,6 +1840,56 @@ void vi(int init)
 	}
 }
 
+static void vi_drawcursor(void)
+{
+	char *ln = lbuf_get(xb, xrow);
+	term_record = 1;
+	term_pos(xrow - xtop, led_pos(ln, ren_cursor(ln, vi_col)) + vi_lncol);
+	term_commit();
+}
+
+/* load more of a large file while waiting for input */
+void vi_load(void)
+{
+	char msg[64];
+	int n = lbuf_len(xb), pct = lbuf_load(1 << 22);
+	if (n < xtop + xrows && lbuf_len(xb) > n)
+		vi_drawagain(xtop);
+	if (pct >= 0) {
+		snprintf(msg, sizeof(msg), "loading %d%%", pct);
+		vi_drawmsg_mpt(msg)
+	} else if (pct < -1)
+		vi_drawmsg_mpt("read failed")
+	else
+		vc_status(0);
+	vi_drawcursor();
+}
+
+/* show lines appended to a followed file while waiting for input */
+void vi_follow(void)
+{
+	int n = lbuf_len(xb), end = xrow >= n - 1, top = xtop;
+	if (!ex_follow())
+		return;
+	if (xfl > 1 && end && lbuf_len(xb) > n) {
+		xrow = lbuf_len(xb) - 1;
+		xoff = 0;
+		vi_col = 0;
+		if (xrow >= xtop + xrows)
+			xtop = xrow - xrows + 1;
+	}
+	vi_drawagain(xtop != top ? xtop : MAX(xtop, n - 1));
+	vc_status(0);
+	vi_drawcursor();
+}
+
+/* report the end of a background write */
+void vi_wbdone(void)
+{
+	vi_drawmsg_mpt(ex_wbdone())
+	vi_drawcursor();
+}
+
 static void sighandler(int signo)
 {
 	term_winch++;
@@ -1890,6 +1945,11 @@ int main(int argc, char *argv[])
 		ex();
 	else
 		vi(1);
+	for (i = 0; i < xbufcur; i++)	/* journals outlive only crashes */
+		lbuf_jclose(bufs[i].lb);
+	for (i = 0; i < LEN(tempbufs); i++)
+		if (tempbufs[i].lb)
+			lbuf_jclose(tempbufs[i].lb);
 	term_done();
 	if (xvis & 8)
 		term_scrl;
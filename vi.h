@@ -100,6 +100,14 @@ struct rcode {
 	int splits;		/* number of split insts */
 	int sparsesz;		/* sdense size */
 	int flg;		/* stored flags */
+	int nfa;		/* boolean matching needs the pike vm */
+	int btrack;		/* the backtracker finds what the pike vm finds */
+	struct rdfa *dfa;	/* lazily built dfa for boolean matching */
+	int *memo;		/* backtracker visited index of jump targets or -1 */
+	int nmemo;		/* number of jump targets */
+	unsigned char first[32];	/* bytes a match may start with */
+	int lithead;		/* lit starts every match */
+	char lit[16];		/* a literal every match contains */
 	int insts[];		/* re code */
 };
 /* regular expression set */
@@ -109,6 +117,7 @@ typedef struct {
 	int *grpnsubc;		/* sub count in each subgroup */
 	int nsubc;		/* total sub count */
 	int n;			/* number of regular expressions in this set */
+	int ref;		/* number of users, including the cache */
 } rset;
 rset *rset_make(int n, char **pat, int flg);
 static rset *rset_smake(char *pat, int flg)
@@ -128,66 +137,146 @@ struct lopt {
 	int pos, pos_off;	/* modification location */
 	int n_ins, n_del;	/* modification range */
 	int seq;		/* operation number */
-	int ref;		/* ins/del ref exists on lbuf */
+	int ref;		/* ins/del ref exists on lbuf, 4: del is journaled only */
+	long mem;		/* bytes held for the side off lbuf */
+	off_t jo;		/* offset of the edit in the journal or -1 */
 };
 struct linfo {
 	int len;
 	int grec;
+	int nchr;	/* characters incl. '\n' if all ASCII, else -1 */
+	int ref;	/* users of an interned record; minus the users past
+			the first of a private one, shared with checkpoints */
+};
+/* read-only file mapping; lines in it are tagged (offset << 1 | 1) in ln[] */
+struct lmap {
+	char *s;			/* mapped file */
+	size_t sz;			/* mapping size */
+	size_t base;			/* tag offset of the mapping */
+	dev_t dev;			/* mapped file device */
+	ino_t ino;			/* mapped file inode */
+};
+/* line record allocator; records up to LA_CLS * 16 bytes come from chunks */
+#define LA_CLS		64
+#define LA_CHUNK	(1 << 20)
+struct lbig { struct lbig *prev, *next; };
+struct larena {
+	char *chunk;			/* chunk list, linked through the first word */
+	char *cur, *end;		/* unused space of the newest chunk */
+	char *free[LA_CLS];		/* freed records by 16 byte size class */
+	struct lbig *big;		/* records too long for a size class */
+	int nbigcls;			/* records in big that fit a size class */
+};
+/* buffer lines are kept in blocks, located by Fenwick trees of their sizes */
+#define LB_MAX		1024
+struct lblk {
+	int n;				/* number of lines in ln[] */
+	long bytes;			/* size of the lines or -1 if unknown */
+	char *z;			/* the lines compressed, without ln[], or NULL */
+	int zn;				/* size of z */
+	int used;			/* idle period of the last access */
+	int pair[3][2];			/* per bracket kind: balance, least depth */
+	int pok;			/* pair[] is up to date */
+	int shr;			/* users past the first, see lbuf_kw() */
+	char *ln[LB_MAX];		/* line records or mapping tags */
+};
+/* the lines of lbuf at hist[h], sharing blocks with it */
+struct lchk {
+	struct lblk **blk;		/* blocks of the lines */
+	int blk_n;			/* number of blocks in blk[] */
+	int ln_n;			/* number of lines */
+	int h;				/* history position of the lines */
 };
 struct lbuf {
-	char **ln;			/* buffer lines */
+	struct lblk **blk;		/* blocks of buffer lines */
+	int *fen;			/* Fenwick tree of block line counts */
+	long *bfen;			/* Fenwick tree of block byte counts */
+	int bfen_ok;			/* bfen[] is up to date */
+	int (*ptree)[3][2];		/* tree of block bracket counts */
+	int ptree_n;			/* leaves of ptree[] or 0 if not made */
+	int blk_n;			/* number of blocks in blk[] */
+	int blk_sz;			/* size of blk[] */
+	int blk_c, blk_o;		/* last used block and its first line */
+	struct lmap *map;		/* file mappings */
+	int map_n;			/* number of mappings in map[] */
+	size_t map_end;			/* next free tag offset */
+	struct larena la;		/* line record allocator */
+	unsigned *hash;			/* line hash & count pairs or NULL */
+	int hash_sz;			/* number of pairs in hash[] */
+	int hash_n;			/* pairs used in hash[] */
 	struct lopt *hist;		/* buffer history */
 	int *mark;			/* mark id, row & off triplets */
 	int mark_n;			/* number of marks in mark[] */
 	int mark_sb[2];			/* [ mark row & off */
 	int mark_se[2];			/* ] mark row & off */
 	int tmp_mark[4];		/* aux mark state */
-	int ln_n;			/* number of lines in ln[] */
-	int ln_sz;			/* size of ln[] */
+	int ln_n;			/* number of buffer lines */
 	int useq;			/* current operation sequence */
 	int modified;			/* modification state */
 	int saved;			/* save state */
+	int wsaved;			/* save state of a pending write */
+	int rderr;			/* the file failed to read in full */
 	int hist_sz;			/* size of hist[] */
 	int hist_n;			/* current history head in hist[] */
 	int hist_u;			/* current undo head in hist[] */
+	long hist_mem;			/* bytes held by hist[] */
+	int hist_j;			/* hist[] below this is journaled */
+	struct lchk *chk;		/* undo checkpoints by position */
+	int chk_n;			/* number of checkpoints in chk[] */
+	int chk_sz;			/* size of chk[] */
+	long chk_work;			/* lines changed since the last one */
+	int jfd;			/* undo journal or -1 */
+	char *jpath;			/* undo journal path */
+	sbuf *jsb;			/* undo journal output buffer */
+	off_t jend;			/* undo journal size */
+	off_t jsaved, jwsaved;		/* journal size at saved and wsaved */
+	char *jfile;			/* path of the file, for the journal */
+	long long jfsz, jfmtime;	/* size and mtime of the file when saved */
+	int zpos, ztick;		/* cold block scan position and period */
+	int ztrim;			/* blocks were compressed in this scan */
 };
 #define lbuf_len(lb) lb->ln_n
 #define lbuf_s(ln) ((struct linfo*)(ln - sizeof(struct linfo)))
-#define lbuf_i(lb, pos) ((struct linfo*)(lb->ln[pos] - sizeof(struct linfo)))
+#define lbuf_i(lb, pos) lbuf_s(lbuf_get(lb, pos))
 struct lbuf *lbuf_make(void);
 void lbuf_free(struct lbuf *lb);
-int lbuf_rd(struct lbuf *lb, int fd, int beg, int end);
+void lbuf_jclose(struct lbuf *lb);
+int lbuf_rd(struct lbuf *lb, int fd, int beg, int end, int bg, int reload);
+int lbuf_load(long max);
+long lbuf_tail(struct lbuf *lb, int fd, long off);
+int lbuf_cold(struct lbuf *lb, int row);
 int lbuf_wr(struct lbuf *lb, int fd, int beg, int end);
+void lbuf_unmap(struct lbuf *lb, struct stat *st);
 void lbuf_edit(struct lbuf *lb, char *s, int beg, int end, int o1, int o2);
 void lbuf_region(struct lbuf *lb, sbuf *sb, int r1, int o1, int r2, int o2);
+void lbuf_move(struct lbuf *lb, int pos, struct lbuf *src, int beg, int end);
 int lbuf_pos2off(struct lbuf *lb, int r1, int o1, int r2, int o2, int row, int off);
 int lbuf_off2pos(struct lbuf *lb, int r1, int o1, int r2, int o2, int boff, int *row, int *off);
 char *lbuf_joinsb(struct lbuf *lb, int r1, int r2, sbuf *i, int *o1, int *o2);
 int lbuf_join(struct lbuf *lb, int beg, int end, int o1, int *o2, int flg);
 char *lbuf_get(struct lbuf *lb, int pos);
+char *lbuf_own(struct lbuf *lb, int pos);
+char **lbuf_lshare(struct lbuf *lb, int beg, int end);
+char **lbuf_lcopy(char **ln, int n);
+void lbuf_ldrop(char **ln, int n);
+void lbuf_lput(struct lbuf *lb, int pos, char **ln, int n, int cnt, int o1);
 void lbuf_smark(struct lbuf *lb, struct lopt *lo, int beg, int o1);
 void lbuf_emark(struct lbuf *lb, struct lopt *lo, int end, int o2);
 struct lopt *lbuf_opt(struct lbuf *lb, int beg, int o1, int n_del);
 void lbuf_mark(struct lbuf *lb, int mk, int pos, int off);
 int lbuf_jump(struct lbuf *lb, int mk, int *pos, int *off);
-int lbuf_undo(struct lbuf *lb, int *row, int *off);
-int lbuf_redo(struct lbuf *lb, int *row, int *off);
+void lbuf_dedup(struct lbuf *lb, char *s, int n);
+int lbuf_undo(struct lbuf *lb, int *row, int *off, int cnt);
+int lbuf_redo(struct lbuf *lb, int *row, int *off, int cnt);
 void lbuf_saved(struct lbuf *lb, int clear);
+void lbuf_jfile(struct lbuf *lb, char *path, long long sz, long long mtime);
+void lbuf_wsaved(struct lbuf *lb, int done);
 int lbuf_indents(struct lbuf *lb, int r);
 int lbuf_eol(struct lbuf *lb, int r, int state);
 int lbuf_next(struct lbuf *lb, int dir, int *r, int *o);
 int lbuf_findchar(struct lbuf *lb, char *cs, int cmd, int n, int *r, int *o);
 int lbuf_search(struct lbuf *lb, rset *re, int dir, int beg, int end, int pskip,
 		int nskip, int *r, int *o);
-#define lbuf_dedup(lb, str, n) \
-{ for (int i = 0; i < lbuf_len(lb);) { \
-	char *s = lbuf_get(lb, i); \
-	if (n == lbuf_s(s)->len && !memcmp(str, s, n)) \
-		lbuf_edit(lb, NULL, i, i + 1, 0, 0); \
-	else \
-		i++; \
-}} \
-
 /* regions */
 int lbuf_sectionbeg(struct lbuf *lb, int dir, int *row, int *off, int ch);
 int lbuf_wordbeg(struct lbuf *lb, int big, int dir, int *row, int *off);
@@ -290,6 +379,18 @@ int uc_slen(char *s);
 char *uc_chrn(char *s, int off, int *n);
 static char *uc_chr(char *s, int off) { int n; return uc_chrn(s, off, &n); }
 int uc_off(char *s, int off);
+/* uc_chr(), uc_off() and uc_slen() for the start of a line record */
+static char *lbuf_chr(char *ln, int off)
+{
+	int n = lbuf_s(ln)->nchr;
+	return n < 0 ? uc_chr(ln, off) : ln + (off < 0 || off > n ? n : off);
+}
+static int lbuf_off(char *ln, int off)
+{
+	int n = lbuf_s(ln)->nchr;
+	return n < 0 ? uc_off(ln, off) : off < 0 ? 0 : MIN(off, n);
+}
+#define lbuf_slen(ln) (lbuf_s(ln)->nchr < 0 ? uc_slen(ln) : lbuf_s(ln)->nchr)
 char *uc_subl(char *s, int beg, int end, int *rlen);
 static char *uc_sub(char *s, int beg, int end)
 	{ int l; return uc_subl(s, beg, end, &l); }
@@ -404,6 +505,7 @@ struct buf {
 	struct lbuf *lb;
 	int plen, row, off, top;
 	long mtime;			/* modification time */
+	long fsz;			/* file size when last read or written */
 	signed char td;			/* text direction */
 };
 /* ex options */
@@ -428,6 +530,16 @@ extern int xmpt;
 extern int xpr;
 extern int xlim;
 extern int xseq;
+extern int xmm;
+extern int xhm;
+extern int xhj;
+extern int xhc;
+extern int xil;
+extern int xzc;
+extern int xfl;
+extern int xwa;
+extern int xws;
+extern int xwb;
 extern int xerr;
 extern int xfr;
 extern int xrr;
@@ -485,12 +597,18 @@ void ex_cprint(char *line, char *ft, int r, int c, int left, int flg);
 #define ex_print(line, ft) { RS(2, ex_cprint(line, ft, -1, 0, 0, 1)); }
 void ex_init(char **files, int n);
 void ex_bufpostfix(struct buf *p, int clear);
+int ex_follow(void);
 int ex_krs(rset **krs, int *dir);
 void ex_krsset(char *kwd, int dir);
 void ex_regesc(sbuf *sb, char *beg, char *end, int ex);
 int ex_edit(const char *path, int len);
+char *ex_wbdone(void);
+extern int xwbfd;
 sbuf *ex_regget(int id);
 void ex_regput(int c, const char *s, int append);
+void ex_regputln(int c, struct lbuf *lb, int beg, int end);
+void ex_regcopy(int dst, int src);
+char **ex_reglines(int id, int *n);
 
 /* conf.c: configuration variables */
 extern const int conf_mode;
@@ -543,6 +661,9 @@ char *conf_digraph(int c1, int c2);
 
 /* vi.c: main */
 void vi(int init);
+void vi_load(void);
+void vi_follow(void);
+void vi_wbdone(void);
 extern int vi_hidch;
 extern int vi_lncol;
 /* filesystem */